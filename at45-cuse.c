@@ -0,0 +1,340 @@
+/*
+ * Copyright (C) 2019 Alexander Amelkin <alexander@amelkin.msk.ru>
+ *
+ * CUSE daemon exposing the AT45DB041E emulator as a spidev character
+ * device, so that the unmodified at45 binary can be run against it:
+ *
+ *	at45-cuse -f --name=spidev-emu [--image=<file>]
+ *	at45 -d /dev/spidev-emu ...
+ *
+ * Every ioctl, byte transferred and the emulated busy time are counted
+ * and reported whenever the device is closed.
+ */
+
+#define FUSE_USE_VERSION 35
+
+#include <cuse_lowlevel.h>
+#include <fuse_opt.h>
+
+#include <sys/ioctl.h>
+#include <linux/spi/spidev.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "transport.h"
+
+#define CUSE_DEVNAME "spidev-emu"
+#define CUSE_XFER_MAX 32 /* Transfers per message */
+
+static struct {
+	char *name;
+	char *image;
+} opts;
+
+static const struct fuse_opt cuse_opts[] = {
+	{ "--name=%s", offsetof(typeof(opts), name), 0 },
+	{ "--image=%s", offsetof(typeof(opts), image), 0 },
+	FUSE_OPT_END
+};
+
+static struct transport *emu;
+static pthread_mutex_t emu_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Current spidev settings, only stored and reported back */
+static uint32_t spi_mode;
+static uint8_t spi_lsb_first;
+static uint8_t spi_bits = 8;
+static uint32_t spi_speed_hz = 500000;
+
+static struct {
+	unsigned long ioctls;
+	unsigned long messages;
+	unsigned long bytes;
+} stats;
+
+static void cuse_open(fuse_req_t req, struct fuse_file_info *fi)
+{
+	fuse_reply_open(req, fi);
+}
+
+static void cuse_release(fuse_req_t req, struct fuse_file_info *fi)
+{
+	(void)fi;
+
+	pthread_mutex_lock(&emu_lock);
+	fprintf(stderr, "%lu ioctls, %lu messages, %lu bytes, %llu us busy\n",
+		stats.ioctls, stats.messages, stats.bytes,
+		(unsigned long long)emu_busy_time(emu));
+	pthread_mutex_unlock(&emu_lock);
+
+	fuse_reply_err(req, 0);
+}
+
+/* Half-duplex access, like spidev read()/write() */
+static int cuse_rw(const void *tx, void *rx, size_t len)
+{
+	struct spi_ioc_transfer xfer = {
+		.tx_buf = (uintptr_t)tx,
+		.rx_buf = (uintptr_t)rx,
+		.len = len,
+	};
+	int rc;
+
+	pthread_mutex_lock(&emu_lock);
+	stats.bytes += len;
+	rc = emu->xfer(emu, &xfer, 1);
+	pthread_mutex_unlock(&emu_lock);
+
+	return rc;
+}
+
+static void cuse_read(fuse_req_t req, size_t size, off_t off,
+		      struct fuse_file_info *fi)
+{
+	uint8_t *buf = malloc(size);
+
+	(void)off;
+	(void)fi;
+
+	if (!buf) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+
+	if (cuse_rw(NULL, buf, size) < 0)
+		fuse_reply_err(req, EIO);
+	else
+		fuse_reply_buf(req, (char *)buf, size);
+	free(buf);
+}
+
+static void cuse_write(fuse_req_t req, const char *buf, size_t size,
+		       off_t off, struct fuse_file_info *fi)
+{
+	(void)off;
+	(void)fi;
+
+	if (cuse_rw(buf, NULL, size) < 0)
+		fuse_reply_err(req, EIO);
+	else
+		fuse_reply_write(req, size);
+}
+
+/*
+ * SPI_IOC_MESSAGE(n) takes a pointer to an array of transfers which in
+ * turn point to the data, so the caller's memory is fetched in two
+ * retries: first the transfers, then all tx buffers together with the
+ * rx buffers to fill.
+ */
+static void cuse_message(fuse_req_t req, void *arg, unsigned int n,
+			 const void *in_buf, size_t in_bufsz, size_t out_bufsz)
+{
+	struct spi_ioc_transfer xfer[CUSE_XFER_MAX];
+	struct iovec in_iov[CUSE_XFER_MAX + 1];
+	struct iovec out_iov[CUSE_XFER_MAX];
+	size_t size = n * sizeof(xfer[0]);
+	size_t tx_total = 0, rx_total = 0;
+	unsigned int in_cnt = 1, out_cnt = 0;
+	const uint8_t *tx;
+	uint8_t *rx;
+	unsigned int i;
+	int rc;
+
+	if (!n || n > CUSE_XFER_MAX) {
+		fuse_reply_err(req, EINVAL);
+		return;
+	}
+
+	in_iov[0].iov_base = arg;
+	in_iov[0].iov_len = size;
+
+	if (!in_bufsz) {
+		fuse_reply_ioctl_retry(req, in_iov, 1, NULL, 0);
+		return;
+	}
+
+	memcpy(xfer, in_buf, size);
+	for (i = 0; i < n; ++i) {
+		if (xfer[i].tx_buf) {
+			in_iov[in_cnt].iov_base = (void *)(uintptr_t)xfer[i].tx_buf;
+			in_iov[in_cnt++].iov_len = xfer[i].len;
+			tx_total += xfer[i].len;
+		}
+		if (xfer[i].rx_buf) {
+			out_iov[out_cnt].iov_base = (void *)(uintptr_t)xfer[i].rx_buf;
+			out_iov[out_cnt++].iov_len = xfer[i].len;
+			rx_total += xfer[i].len;
+		}
+	}
+
+	if ((tx_total || rx_total) &&
+	    (in_bufsz != size + tx_total || out_bufsz != rx_total)) {
+		fuse_reply_ioctl_retry(req, in_iov, in_cnt, out_iov, out_cnt);
+		return;
+	}
+
+	rx = malloc(rx_total ? rx_total : 1);
+	if (!rx) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+
+	/* Point the transfers to the local copies */
+	tx = (const uint8_t *)in_buf + size;
+	for (i = 0, rx_total = 0; i < n; ++i) {
+		if (xfer[i].tx_buf) {
+			xfer[i].tx_buf = (uintptr_t)tx;
+			tx += xfer[i].len;
+		}
+		if (xfer[i].rx_buf) {
+			xfer[i].rx_buf = (uintptr_t)(rx + rx_total);
+			rx_total += xfer[i].len;
+		}
+	}
+
+	pthread_mutex_lock(&emu_lock);
+	stats.messages++;
+	for (i = 0; i < n; ++i)
+		stats.bytes += xfer[i].len;
+	rc = emu->xfer(emu, xfer, n);
+	pthread_mutex_unlock(&emu_lock);
+
+	if (rc < 0)
+		fuse_reply_err(req, EIO);
+	else
+		fuse_reply_ioctl(req, rc, rx, rx_total);
+	free(rx);
+}
+
+/* Settings: `val` is read from or written to the caller's `arg` */
+static void cuse_setting(fuse_req_t req, unsigned int cmd, void *arg,
+			 void *val, const void *in_buf, size_t in_bufsz,
+			 size_t out_bufsz)
+{
+	struct iovec iov = { arg, _IOC_SIZE(cmd) };
+
+	if (_IOC_DIR(cmd) & _IOC_WRITE) {
+		if (!in_bufsz) {
+			fuse_reply_ioctl_retry(req, &iov, 1, NULL, 0);
+			return;
+		}
+		memcpy(val, in_buf, iov.iov_len);
+		fuse_reply_ioctl(req, 0, NULL, 0);
+		return;
+	}
+
+	if (!out_bufsz) {
+		fuse_reply_ioctl_retry(req, NULL, 0, &iov, 1);
+		return;
+	}
+	fuse_reply_ioctl(req, 0, val, iov.iov_len);
+}
+
+static void cuse_ioctl(fuse_req_t req, unsigned int cmd, void *arg,
+		       struct fuse_file_info *fi, unsigned int flags,
+		       const void *in_buf, size_t in_bufsz, size_t out_bufsz)
+{
+	uint8_t mode8 = spi_mode;
+
+	(void)fi;
+
+	if (flags & FUSE_IOCTL_COMPAT) {
+		fuse_reply_err(req, ENOSYS);
+		return;
+	}
+
+	if (!in_bufsz && !out_bufsz)
+		__atomic_add_fetch(&stats.ioctls, 1, __ATOMIC_RELAXED);
+
+	switch (cmd) {
+	case SPI_IOC_RD_MODE:
+		cuse_setting(req, cmd, arg, &mode8, in_buf, in_bufsz,
+			     out_bufsz);
+		break;
+	case SPI_IOC_WR_MODE:
+		cuse_setting(req, cmd, arg, &mode8, in_buf, in_bufsz,
+			     out_bufsz);
+		spi_mode = (spi_mode & ~0xFF) | mode8;
+		break;
+	case SPI_IOC_RD_MODE32:
+	case SPI_IOC_WR_MODE32:
+		cuse_setting(req, cmd, arg, &spi_mode, in_buf, in_bufsz,
+			     out_bufsz);
+		break;
+	case SPI_IOC_RD_LSB_FIRST:
+	case SPI_IOC_WR_LSB_FIRST:
+		cuse_setting(req, cmd, arg, &spi_lsb_first, in_buf, in_bufsz,
+			     out_bufsz);
+		break;
+	case SPI_IOC_RD_BITS_PER_WORD:
+	case SPI_IOC_WR_BITS_PER_WORD:
+		cuse_setting(req, cmd, arg, &spi_bits, in_buf, in_bufsz,
+			     out_bufsz);
+		break;
+	case SPI_IOC_RD_MAX_SPEED_HZ:
+	case SPI_IOC_WR_MAX_SPEED_HZ:
+		cuse_setting(req, cmd, arg, &spi_speed_hz, in_buf, in_bufsz,
+			     out_bufsz);
+		break;
+	default:
+		if (_IOC_TYPE(cmd) == SPI_IOC_MAGIC && _IOC_NR(cmd) == 0 &&
+		    _IOC_DIR(cmd) == _IOC_WRITE &&
+		    !(_IOC_SIZE(cmd) % sizeof(struct spi_ioc_transfer))) {
+			cuse_message(req, arg,
+				     _IOC_SIZE(cmd) / sizeof(struct spi_ioc_transfer),
+				     in_buf, in_bufsz, out_bufsz);
+			break;
+		}
+		fuse_reply_err(req, ENOTTY);
+		break;
+	}
+}
+
+static const struct cuse_lowlevel_ops cuse_ops = {
+	.open = cuse_open,
+	.release = cuse_release,
+	.read = cuse_read,
+	.write = cuse_write,
+	.ioctl = cuse_ioctl,
+};
+
+int main(int argc, char *argv[])
+{
+	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+	char devname[128];
+	const char *dev_info_argv[] = { devname };
+	struct cuse_info ci = { 0 };
+	int ret;
+
+	if (fuse_opt_parse(&args, &opts, cuse_opts, NULL))
+		return EXIT_FAILURE;
+
+	snprintf(devname, sizeof(devname), "DEVNAME=%s",
+		 opts.name ? opts.name : CUSE_DEVNAME);
+
+	emu = emu_open(opts.image);
+	if (!emu) {
+		perror(opts.image ? opts.image : "emulator");
+		return EXIT_FAILURE;
+	}
+
+	ci.dev_info_argc = 1;
+	ci.dev_info_argv = dev_info_argv;
+	ci.flags = CUSE_UNRESTRICTED_IOCTL;
+
+	ret = cuse_lowlevel_main(args.argc, args.argv, &ci, &cuse_ops, NULL);
+
+	if (emu->close(emu)) {
+		perror(opts.image);
+		ret = EXIT_FAILURE;
+	}
+	fuse_opt_free_args(&args);
+	return ret;
+}
@@ -2,13 +2,16 @@
  * Copyright (C) 2019 Alexander Amelkin <alexander@amelkin.msk.ru>
  */
 
+#define _GNU_SOURCE
+
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <fcntl.h>
 
 #include <unistd.h>
-#include <sys/ioctl.h>
-#include <linux/spi/spidev.h>
 
 #include <stdbool.h>
 #include <stdint.h>
@@ -18,39 +21,35 @@
 #include <limits.h>
 
 #include <getopt.h>
+#include <glob.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <errno.h>
 
-#define JEDEC_ID_CMD 0x9F
-#define AT45_STATUS_CMD 0xD7
-#define AT45_PAGE_256 0xA6
-#define AT45_PAGE_264 0xA7
-#define AT45_SET_PAGE_SZ 0x3D, 0x2A, 0x80
+#include "at45.h"
+#include "at45d.h"
+#include "blank.h"
+#include "transport.h"
 
 #define ARRAY_SZ(x) (sizeof(x) / sizeof((x)[0]))
-#define SPI_XFER(arr) SPI_IOC_MESSAGE(ARRAY_SZ(arr)), (arr)
 
-#define SPI_SPEED_HZ 40000000
 #define DEFAULT_SPIDEV "/dev/spidev0.0"
-#define SPI_CMD_DELAY 100000
 
-struct {
-	uint32_t jedec_id;
-	char *name;
-} chips[] = {
-	0x0100241F, "Adesto AT45DB041E",
-	0, NULL /* End of chips */
-};
+/* --daemon */
+#define AT45D_DEVS 16
+#define AT45D_CLIENTS 16
+#define AT45D_NAME_MAX 256 /* Longest device name to open */
+#define AT45D_SOCKET_MODE 0660 /* Owner and group may program the flash */
 
 struct {
 	char *descr[2]; /* false, true */
 } status_bits[] = {
-	[0] = { "Device is configured for standard DataFlash page size (264 bytes)",
-		"Device is configured for 'power of 2' binary page size (256 bytes)" },
+	[0] = { "Device is configured for standard DataFlash page size",
+		"Device is configured for 'power of 2' binary page size" },
 	[1] = { "Sector protection is disabled",
 		"Sector protection is enabled" },
-	[2] = { "Unknown density", "4-Mbit" },
-	[3] = { "Unknown density", "4-Mbit" },
-	[4] = { "Unknown density", "4-Mbit" },
-	[5] = { "4-Mbit", "Unknown density" },
+	/* Bits 2-5 are the density code, see print_density() */
 	[6] = { "Main memory page data matches buffer data",
 		"Main memory page data does not match buffer data" },
 	[7] = { "Device is busy with an internal operation",
@@ -71,92 +70,1214 @@ struct {
 		 "Device is ready" },
 };
 
-#define DEF_SPI_CMD(cmd, snd, rcv) \
-	struct spi_ioc_transfer cmd[2] = { \
-		{ \
-			.tx_buf = (uintptr_t)(snd), \
-			.rx_buf = (uintptr_t)(rcv), \
-			.len = sizeof(snd), \
-			.tx_nbits = CHAR_BIT * sizeof(snd), \
-			.rx_nbits = CHAR_BIT * sizeof(rcv), \
-			.cs_change = 1, \
-			.speed_hz = SPI_SPEED_HZ \
-		} \
+#define STATUS_DENSITY_SHIFT 2
+#define STATUS_DENSITY_MASK 0xF
+
+/* Density codes are 0011b for 1 Mbit, and one more bit for every doubling */
+void print_density(int status)
+{
+	unsigned int code = (status >> STATUS_DENSITY_SHIFT) &
+			    STATUS_DENSITY_MASK;
+
+	if (code >= 3 && code & 1)
+		printf("\t[05:02]: %X = %u-Mbit\n", code, 1 << (code / 2 - 1));
+	else
+		printf("\t[05:02]: %X = Unknown density\n", code);
+}
+
+/* Open `name`, telling why not */
+struct at45_dev *open_dev(const char *name, const struct at45_conf *conf)
+{
+	struct at45_dev *dev;
+	int rc = at45_open(&dev, name, conf);
+
+	if (rc == -ENODEV)
+		printf("%s: No supported chips found\n", name);
+	else if (rc)
+		printf("%s: %s\n", name, strerror(-rc));
+
+	return rc ? NULL : dev;
+}
+
+/* Close `dev` opened as `name`, telling why that failed */
+bool close_dev(const char *name, struct at45_dev *dev)
+{
+	int rc = at45_close(dev);
+
+	if (rc)
+		printf("%s: %s\n", name, strerror(-rc));
+
+	return rc;
+}
+
+/* Read the settings for `name` into `conf`, telling what is wrong */
+bool load_conf(const char *name, struct at45_conf *conf)
+{
+	unsigned int line;
+	int rc = conf_load(name, conf, &line);
+
+	if (rc && line)
+		printf("%s:%u: %s\n", conf_path(), line,
+		       rc == -EINVAL ? "Invalid option" : strerror(-rc));
+	else if (rc)
+		printf("%s: %s\n", conf_path(), strerror(-rc));
+
+	return rc;
+}
+
+/* Report the failure of `what` with library or daemon result `rc` */
+void report_failure(const char *what, int rc)
+{
+	if (rc == INT32_MIN) /* at45d_call() told why */
+		printf("Failed to %s\n", what);
+	else
+		printf("Failed to %s: %s\n", what, strerror(-rc));
+}
+
+/* The erases and programs of `plan`, and how long they should take */
+void print_plan(const struct chip *chip, const struct plan *plan)
+{
+	static const char *op_names[] = {
+		[AT45_OP_BE] = "Block erase",
+		[AT45_OP_SE] = "Sector erase",
+		[AT45_OP_CE] = "Chip erase",
+	};
+	static const char *action_names[] = {
+		[PLAN_PROG] = "Program",
+		[PLAN_EP] = "Erase and program",
+		[PLAN_PE] = "Page erase",
+	};
+	unsigned int i, page, end;
+
+	for (i = 0; i < plan->n_ops; ++i) {
+		const struct plan_op *op = &plan->ops[i];
+
+		printf("%-18s pages %u-%u\n", op_names[op->op],
+		       op->page, op->page + op->pages - 1);
 	}
 
-#define DO_XFER(cmd, rval) \
-	if (0 > ioctl(fd, SPI_XFER(cmd))) { \
-		perror(__func__); \
-		return (rval); \
+	for (page = 0; page < chip->pages; page = end) {
+		for (end = page + 1; end < chip->pages; ++end) {
+			if (plan->action[end] != plan->action[page])
+				break;
+		}
+		if (plan->action[page] != PLAN_NONE)
+			printf("%-18s pages %u-%u\n",
+			       action_names[plan->action[page]], page, end - 1);
 	}
 
+	printf("Estimated time %.3f s\n", plan->cost / 1000000.0);
+}
+
+/* Program `data`, or erase if NULL, or only show how with `plan_only` */
+int flash(struct at45_dev *dev, const uint8_t *data, uint32_t offset,
+	  size_t len, unsigned int mode, bool plan_only)
+{
+	struct plan plan;
+	int rc;
+
+	if (!plan_only)
+		return at45_write(dev, data, offset, len, mode);
+
+	rc = at45_plan(dev, data, offset, len, mode, &plan);
+	if (rc)
+		return rc;
+
+	print_plan(at45_chip(dev), &plan);
+	at45_plan_free(&plan);
+	return 0;
+}
 
-uint32_t get_jedec_id(int fd)
+void tune_step(void *arg, uint8_t opcode, uint32_t hz, bool good)
 {
-	uint8_t send_data[6] = { JEDEC_ID_CMD };
-	uint8_t recv_data[6] = { 0 };
-	DEF_SPI_CMD(jedec_id, send_data, recv_data);
-	DO_XFER(jedec_id, UINT32_MAX);
+	(void)arg;
+	printf("%02Xh at %9u Hz: %s\n", opcode, hz, good ? "good" : "errors");
+}
+
+/*
+ * Map the whole file read-only. Transfers point straight into the
+ * mapping, so the image is never copied and only the pages being sent
+ * are resident. Release with unmap_file().
+ */
+const uint8_t *map_file(const char *path, size_t *len)
+{
+	static const uint8_t empty;
+	const uint8_t *data = NULL;
+	struct stat st;
+	void *map;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st)) {
+		perror(path);
+		goto out;
+	}
+
+	*len = st.st_size;
+	if (!*len) {
+		data = &empty;
+		goto out;
+	}
+
+	map = mmap(NULL, *len, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED) {
+		perror(path);
+		goto out;
+	}
+	madvise(map, *len, MADV_SEQUENTIAL);
+	data = map;
+
+out:
+	if (fd >= 0)
+		close(fd);
+	return data;
+}
 
-	return *(uint32_t *)(recv_data + 1);
+void unmap_file(const uint8_t *data, size_t len)
+{
+	if (len)
+		munmap((void *)data, len);
 }
 
-int at45_get_status(int fd)
+bool read_full(int fd, void *buf, size_t len)
 {
-	uint8_t send_data[3] = { AT45_STATUS_CMD };
-	uint8_t recv_data[3] = { 0 };
-	DEF_SPI_CMD(status, send_data, recv_data);
-	DO_XFER(status, -1);
+	while (len) {
+		ssize_t rc = read(fd, buf, len);
 
-	return *(uint16_t *)(recv_data + 1);
+		if (rc <= 0)
+			return true;
+		buf = (uint8_t *)buf + rc;
+		len -= rc;
+	}
+
+	return false;
 }
 
-bool at45_set_page_sz(int fd, uint8_t page_sz)
+bool write_full(int fd, const void *buf, size_t len)
 {
-	uint8_t send_data[4] = { AT45_SET_PAGE_SZ, 0 };
-	uint8_t recv_data[4] = { 0 }; /* Ignore */
-	DEF_SPI_CMD(set_page_sz, send_data, recv_data);
-	send_data[3] = page_sz;
-	DO_XFER(set_page_sz, true);
+	while (len) {
+		ssize_t rc = write(fd, buf, len);
+
+		if (rc <= 0)
+			return true;
+		buf = (const uint8_t *)buf + rc;
+		len -= rc;
+	}
 
 	return false;
 }
 
-int main(int argc, char *argv[])
+/* A device served by the daemon, opened and probed once */
+struct at45d_dev {
+	const char *name;
+	struct at45_dev *dev;
+};
+
+/* Serve one request, the data of write requests is in `data` */
+int at45d_handle(struct at45d_dev *devs, unsigned int n_devs,
+		 const struct at45d_req *req, const uint8_t *data,
+		 uint8_t **out, uint32_t *out_len)
+{
+	struct at45_dev *dev;
+	size_t chip_sz;
+	unsigned int i;
+	int rc;
+
+	*out_len = 0;
+
+	if (req->op == AT45D_OPEN) {
+		struct at45d_info *info;
+
+		for (i = 0; i < n_devs; ++i) {
+			if (strlen(devs[i].name) == req->len &&
+			    !memcmp(devs[i].name, data, req->len))
+				break;
+		}
+		if (i == n_devs)
+			return -ENODEV;
+
+		info = malloc(sizeof(*info));
+		if (!info)
+			return -ENOMEM;
+		info->jedec_id = at45_chip(devs[i].dev)->jedec_id;
+		info->page_sz = at45_page_size(devs[i].dev);
+		*out = (uint8_t *)info;
+		*out_len = sizeof(*info);
+		return i;
+	}
+
+	if (req->dev >= n_devs)
+		return -ENODEV;
+
+	dev = devs[req->dev].dev;
+	chip_sz = (size_t)at45_chip(dev)->pages * at45_page_size(dev);
+
+	switch (req->op) {
+	case AT45D_STATUS:
+		return at45_status(dev);
+	case AT45D_PAGE_SZ:
+		return at45_set_page_size(dev, req->arg == 256);
+	case AT45D_READ:
+		if (req->offset >= chip_sz || req->len > chip_sz - req->offset)
+			return -EINVAL;
+		*out = malloc(req->len ? req->len : 1);
+		if (!*out)
+			return -ENOMEM;
+		rc = at45_read(dev, req->offset, *out, req->len);
+		if (rc)
+			return rc;
+		*out_len = req->len;
+		return 0;
+	case AT45D_WRITE:
+	case AT45D_ERASE:
+		return at45_write(dev, req->op == AT45D_WRITE ? data : NULL,
+				  req->offset, req->len,
+				  req->arg & (AT45_FLASH_UPDATE |
+					      AT45_FLASH_NO_ERASE));
+	case AT45D_VERIFY:
+		return at45_verify(dev, data, req->offset, req->len, NULL);
+	default:
+		return -EINVAL;
+	}
+}
+
+/*
+ * A client connection. Requests and responses move in pieces as the
+ * socket allows, so a slow client holds up nobody else.
+ */
+struct at45d_conn {
+	struct at45d_req req;
+	uint8_t *data; /* Following the request */
+	size_t in; /* Bytes of the request and its data received */
+	bool replying; /* The request is served, the response is going out */
+	struct at45d_resp resp;
+	uint8_t *out; /* Following the response */
+	size_t sent; /* Bytes of the response and its data sent */
+	bool drop; /* Close once the response is out */
+};
+
+/* Bytes of data following request `req` */
+size_t at45d_req_data(const struct at45d_req *req)
+{
+	if (req->op == AT45D_OPEN || req->op == AT45D_WRITE ||
+	    req->op == AT45D_VERIFY)
+		return req->len;
+
+	return 0;
+}
+
+/* Check request `req` before any of its data is taken */
+int at45d_check(struct at45d_dev *devs, unsigned int n_devs,
+		const struct at45d_req *req)
+{
+	struct at45_dev *dev;
+	size_t chip_sz;
+
+	if (req->op == AT45D_OPEN)
+		return req->len > AT45D_NAME_MAX ? -ENAMETOOLONG : 0;
+
+	if (req->dev >= n_devs)
+		return -ENODEV;
+
+	if (!at45d_req_data(req))
+		return 0;
+
+	dev = devs[req->dev].dev;
+	chip_sz = (size_t)at45_chip(dev)->pages * at45_page_size(dev);
+	if (req->offset >= chip_sz || req->len > chip_sz - req->offset)
+		return -EINVAL;
+
+	return 0;
+}
+
+void at45d_conn_reset(struct at45d_conn *c)
+{
+	free(c->data);
+	free(c->out);
+	memset(c, 0, sizeof(*c));
+}
+
+/*
+ * Take what the client has sent. Once a request is complete, it is
+ * served and the response is made ready. A request that fails the
+ * check is answered without taking its data, and the client is
+ * dropped afterwards. Returns true if the client is gone.
+ */
+bool at45d_receive(int fd, struct at45d_conn *c, struct at45d_dev *devs,
+		   unsigned int n_devs)
+{
+	size_t total = sizeof(c->req);
+	ssize_t rc;
+
+	for (;;) {
+		if (c->in >= sizeof(c->req))
+			total = sizeof(c->req) + at45d_req_data(&c->req);
+
+		if (c->in == sizeof(c->req) && !c->data) {
+			c->resp.result = at45d_check(devs, n_devs, &c->req);
+			if (!c->resp.result) {
+				c->data = malloc(total - c->in + 1);
+				if (!c->data)
+					c->resp.result = -ENOMEM;
+			}
+			if (c->resp.result) {
+				c->drop = true;
+				c->replying = true;
+				return false;
+			}
+		}
+		if (c->in == total && c->data)
+			break;
+
+		if (c->in < sizeof(c->req))
+			rc = read(fd, (uint8_t *)&c->req + c->in,
+				  sizeof(c->req) - c->in);
+		else
+			rc = read(fd, c->data + c->in - sizeof(c->req),
+				  total - c->in);
+		if (rc < 0 && errno == EINTR)
+			continue;
+		if (rc < 0 && errno == EAGAIN)
+			return false;
+		if (rc <= 0)
+			return true;
+		c->in += rc;
+	}
+
+	c->resp.result = at45d_handle(devs, n_devs, &c->req, c->data, &c->out,
+				      &c->resp.len);
+	c->replying = true;
+	return false;
+}
+
+/* Send what the socket takes of the response, true if the client is gone */
+bool at45d_send(int fd, struct at45d_conn *c)
+{
+	size_t total = sizeof(c->resp) + c->resp.len;
+	ssize_t rc;
+
+	while (c->sent < total) {
+		if (c->sent < sizeof(c->resp))
+			rc = write(fd, (uint8_t *)&c->resp + c->sent,
+				   sizeof(c->resp) - c->sent);
+		else
+			rc = write(fd, c->out + c->sent - sizeof(c->resp),
+				   total - c->sent);
+		if (rc < 0 && errno == EINTR)
+			continue;
+		if (rc < 0 && errno == EAGAIN)
+			return false;
+		if (rc <= 0)
+			return true;
+		c->sent += rc;
+	}
+
+	if (c->drop)
+		return true;
+
+	at45d_conn_reset(c);
+	return false;
+}
+
+volatile sig_atomic_t at45d_stop;
+
+static void at45d_signal(int sig)
+{
+	(void)sig;
+	at45d_stop = 1;
+}
+
+/*
+ * Serve requests for the devices in `names` on Unix socket `path`
+ * until SIGINT or SIGTERM. Every device is opened and probed once.
+ * Requests from any number of clients are served one at a time. The
+ * socket is accessible to the owner and the group only.
+ */
+bool at45d_run(const char *path, char *const *names, unsigned int n_devs)
 {
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	struct at45d_dev devs[AT45D_DEVS] = { 0 };
+	struct pollfd fds[1 + AT45D_CLIENTS] = { { .fd = -1 } };
+	struct at45d_conn conns[1 + AT45D_CLIENTS] = { 0 };
+	struct sigaction sa = { .sa_handler = at45d_signal };
+	unsigned int n_fds = 1, i;
+	bool err = true;
+	mode_t mask;
+	int rc;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		printf("Socket path %s is too long\n", path);
+		return true;
+	}
+	if (n_devs > AT45D_DEVS) {
+		printf("At most %u devices can be served\n", AT45D_DEVS);
+		return true;
+	}
+	strcpy(addr.sun_path, path);
+	setvbuf(stdout, NULL, _IOLBF, 0);
+
+	for (i = 0; i < n_devs; ++i) {
+		devs[i].name = names[i];
+		devs[i].dev = open_dev(names[i], NULL);
+		if (!devs[i].dev)
+			goto out;
+		printf("Serving %s (%s, %u byte pages)\n", names[i],
+		       at45_chip(devs[i].dev)->name,
+		       at45_page_size(devs[i].dev));
+	}
+
+	fds[0].fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	fds[0].events = POLLIN;
+	unlink(path);
+	if (fds[0].fd < 0) {
+		perror(path);
+		goto out;
+	}
+
+	mask = umask(0777 & ~AT45D_SOCKET_MODE);
+	rc = bind(fds[0].fd, (struct sockaddr *)&addr, sizeof(addr));
+	umask(mask);
+	if (rc || listen(fds[0].fd, AT45D_CLIENTS)) {
+		perror(path);
+		goto out;
+	}
+
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	while (!at45d_stop) {
+		if (poll(fds, n_fds, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror(__func__);
+			goto out;
+		}
+
+		for (i = n_fds - 1; i > 0; --i) {
+			struct at45d_conn *c = &conns[i];
+			bool gone;
+
+			if (!fds[i].revents)
+				continue;
+
+			gone = !(fds[i].revents & (POLLIN | POLLOUT));
+			if (!gone && !c->replying)
+				gone = at45d_receive(fds[i].fd, c, devs, n_devs);
+			if (!gone && c->replying)
+				gone = at45d_send(fds[i].fd, c);
+			if (gone) {
+				close(fds[i].fd);
+				at45d_conn_reset(c);
+				fds[i] = fds[--n_fds];
+				conns[i] = conns[n_fds];
+				memset(&conns[n_fds], 0, sizeof(conns[n_fds]));
+				continue;
+			}
+			fds[i].events = c->replying ? POLLOUT : POLLIN;
+		}
+
+		if (fds[0].revents & POLLIN) {
+			int fd = accept4(fds[0].fd, NULL, NULL,
+					 SOCK_CLOEXEC | SOCK_NONBLOCK);
+
+			if (fd < 0)
+				continue;
+			if (n_fds == ARRAY_SZ(fds)) {
+				close(fd);
+				continue;
+			}
+			fds[n_fds].fd = fd;
+			fds[n_fds++].events = POLLIN;
+		}
+	}
+
+	err = false;
+out:
+	for (i = 1; i < n_fds; ++i) {
+		close(fds[i].fd);
+		at45d_conn_reset(&conns[i]);
+	}
+	if (fds[0].fd >= 0) {
+		close(fds[0].fd);
+		unlink(path);
+	}
+	for (i = 0; i < n_devs; ++i) {
+		if (close_dev(names[i], devs[i].dev))
+			err = true;
+	}
+	return err;
+}
+
+/* Connection to a daemon serving one device */
+struct at45d_client {
 	int fd;
+	uint8_t dev;
+	struct at45d_info info;
+};
+
+/*
+ * Send request `op` with `len` bytes of `data` if the op carries data
+ * and receive the response data into `*out` (allocated, NULL if none).
+ * Returns the result or INT32_MIN if the daemon can't be reached.
+ */
+int at45d_call(struct at45d_client *c, uint8_t op, uint16_t arg,
+	       uint32_t offset, uint32_t len, const void *data, uint8_t **out)
+{
+	struct at45d_req req = { op, c->dev, arg, offset, len };
+	struct at45d_resp resp;
+	uint8_t *buf = NULL;
+
+	if (write_full(c->fd, &req, sizeof(req)) ||
+	    (data && write_full(c->fd, data, len)) ||
+	    read_full(c->fd, &resp, sizeof(resp)))
+		goto fail;
+
+	if (resp.len) {
+		buf = malloc(resp.len);
+		if (!buf || read_full(c->fd, buf, resp.len))
+			goto fail;
+	}
+
+	if (out)
+		*out = buf;
+	else
+		free(buf);
+	return resp.result;
+
+fail:
+	perror(__func__);
+	free(buf);
+	return INT32_MIN;
+}
+
+bool at45d_connect(struct at45d_client *c, const char *path,
+		   const char *devname)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	uint8_t *info = NULL;
+	int rc;
+
+	strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+	c->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (c->fd < 0 ||
+	    connect(c->fd, (struct sockaddr *)&addr, sizeof(addr))) {
+		perror(path);
+		return true;
+	}
+
+	rc = at45d_call(c, AT45D_OPEN, 0, 0, strlen(devname), devname, &info);
+	if (rc < 0 || !info) {
+		if (rc != INT32_MIN)
+			printf("%s is not served by %s\n", devname, path);
+		free(info);
+		return true;
+	}
+
+	c->dev = rc;
+	memcpy(&c->info, info, sizeof(c->info));
+	free(info);
+	return false;
+}
+
+/* Completed requests taken off the queue at once */
+#define GANG_REAP 16
+#define GANG_PARTS 3
+
+/* Pages of the image programmed from one buffer */
+struct gang_part {
+	unsigned int page;
+	unsigned int pages;
+	const uint8_t *buf;
+};
+
+/* A device programmed by gang_run() */
+struct gang_dev {
+	const char *name;
+	char bus[PATH_MAX]; /* See at45_bus_name() */
+	struct gang_dev *next; /* On the same bus */
+	bool first; /* On its bus, runs the bus thread */
+	pthread_t thread;
+	bool started;
+	struct at45_conf conf;
+	bool stream_status;
+	const uint8_t *data; /* Shared by all devices */
+	uint32_t offset;
+	size_t len;
+	unsigned int mode;
+	struct at45_dev *dev;
+	const struct chip *chip;
+	uint8_t *edge; /* Partial first and last pages completed */
+	struct gang_part part[GANG_PARTS];
+	unsigned int n_parts;
+	/* What is on chip: blank check or compare of the parts */
+	struct at45_req probe[GANG_PARTS];
+	unsigned int probing; /* Probes not completed yet */
+	unsigned int blank; /* Blank pages at the start of the range */
+	uint8_t *differ; /* Pages that differ from the image */
+	struct at45_req *reqs;
+	unsigned int n_reqs;
+	int mismatches;
+	const char *failed; /* Step that failed, NULL on success */
+	int rc; /* Pages programmed, or the error or mismatches of `failed` */
+	struct at45_stats stats;
+};
+
+/* Read `page` into `buf` and lay the part of the image it holds over it */
+bool gang_edge(struct gang_dev *g, unsigned int page, uint8_t *buf)
+{
+	unsigned int page_sz = at45_page_size(g->dev);
+	uint32_t start = page * page_sz, end = start + page_sz;
+
+	g->rc = at45_read(g->dev, start, buf, page_sz);
+	if (g->rc)
+		return true;
+
+	if (start < g->offset)
+		start = g->offset;
+	if (end > g->offset + g->len)
+		end = g->offset + g->len;
+	memcpy(buf + start % page_sz, g->data + (start - g->offset),
+	       end - start);
+	return false;
+}
+
+/*
+ * Split the range of `g` into up to 3 parts: whole pages come straight
+ * from the image, partial pages at either end are read back and
+ * completed with the image first.
+ */
+bool gang_parts(struct gang_dev *g)
+{
+	unsigned int page_sz = at45_page_size(g->dev);
+	unsigned int lo = g->offset / page_sz;
+	unsigned int hi = (g->offset + g->len + page_sz - 1) / page_sz;
+	unsigned int end = hi;
+	struct gang_part *part = g->part;
+
+	g->edge = malloc(2 * page_sz);
+	if (!g->edge) {
+		g->rc = -ENOMEM;
+		return true;
+	}
+
+	if (g->offset % page_sz || g->offset + g->len < (lo + 1) * page_sz) {
+		if (gang_edge(g, lo, g->edge))
+			return true;
+		part[g->n_parts++] = (struct gang_part){ lo++, 1, g->edge };
+	}
+	if (hi > lo && (g->offset + g->len) % page_sz) {
+		if (gang_edge(g, --hi, g->edge + page_sz))
+			return true;
+	}
+	if (hi > lo) {
+		part[g->n_parts++] = (struct gang_part){
+			lo, hi - lo, g->data + (lo * page_sz - g->offset) };
+	}
+	if (hi < end) {
+		part[g->n_parts++] = (struct gang_part){
+			hi, 1, g->edge + page_sz };
+	}
+
+	return false;
+}
+
+/* Set `req` up for `pages` pages at `page` of `buf` */
+void gang_req(struct gang_dev *g, struct at45_req *req, enum at45_req_op op,
+	      unsigned int page, unsigned int pages, const uint8_t *buf,
+	      unsigned int mode)
+{
+	unsigned int page_sz = at45_page_size(g->dev);
+
+	*req = (struct at45_req){
+		.op = op,
+		.dev = g->dev,
+		.offset = page * page_sz,
+		.len = (size_t)pages * page_sz,
+		.buf = (void *)buf,
+		.mode = mode,
+		.user = g,
+	};
+}
+
+/* Append a request to those queued once the probes are done */
+void gang_add(struct gang_dev *g, enum at45_req_op op, unsigned int page,
+	      unsigned int pages, const uint8_t *buf, unsigned int mode)
+{
+	gang_req(g, &g->reqs[g->n_reqs++], op, page, pages, buf, mode);
+}
+
+/*
+ * Set `g` up and queue the probes of what is on chip: an update
+ * compares the parts with the image, a write checks if the range is
+ * blank already. The probes of all devices on the bus interleave like
+ * the programs that follow.
+ */
+bool gang_probe(struct at45_queue *q, struct gang_dev *g)
+{
+	unsigned int page_sz = at45_page_size(g->dev);
+	unsigned int first = g->offset / page_sz;
+	unsigned int count = (g->offset + g->len + page_sz - 1) / page_sz -
+			     first;
+	unsigned int i;
+
+	g->failed = "program";
+	if (!count)
+		return false;
+
+	/* An erase, runs of differing pages and a write and a verify per part */
+	g->reqs = calloc(count / 2 + 2 + 3 * GANG_PARTS, sizeof(*g->reqs));
+	if (!g->reqs) {
+		g->rc = -ENOMEM;
+		return true;
+	}
+
+	if (gang_parts(g))
+		return true;
+
+	if (g->mode & AT45_FLASH_UPDATE) {
+		g->differ = calloc(g->chip->pages / 8 + 1, 1);
+		if (!g->differ) {
+			g->rc = -ENOMEM;
+			return true;
+		}
+		for (i = 0; i < g->n_parts; ++i) {
+			gang_req(g, &g->probe[i], AT45_REQ_VERIFY,
+				 g->part[i].page, g->part[i].pages,
+				 g->part[i].buf, 0);
+			g->probe[i].mismatch = g->differ;
+		}
+		g->probing = g->n_parts;
+	}
+	else if (!(g->mode & AT45_FLASH_NO_ERASE)) {
+		gang_req(g, &g->probe[0], AT45_REQ_BLANK, first, count, NULL,
+			 0);
+		g->probing = 1;
+	}
+
+	for (i = 0; i < g->probing; ++i) {
+		g->rc = at45_submit(q, &g->probe[i]);
+		if (g->rc)
+			return true;
+	}
+
+	return false;
+}
+
+/*
+ * Queue the programming of `g` as the probes found the chip. A write
+ * erases the range unless it is blank already and programs it all; an
+ * update programs, with the built-in erase, only the pages that
+ * differ. Every part is verified afterwards.
+ */
+bool gang_program(struct at45_queue *q, struct gang_dev *g)
+{
+	unsigned int page_sz = at45_page_size(g->dev);
+	unsigned int first = g->offset / page_sz;
+	unsigned int count = (g->offset + g->len + page_sz - 1) / page_sz -
+			     first;
+	unsigned int i;
+
+	if (!(g->mode & (AT45_FLASH_UPDATE | AT45_FLASH_NO_ERASE)) &&
+	    g->blank < count)
+		gang_add(g, AT45_REQ_ERASE, first, count, NULL, 0);
+
+	for (i = 0; i < g->n_parts; ++i) {
+		struct gang_part *p = &g->part[i];
+		unsigned int page, start, end = p->page + p->pages;
+
+		if (!g->differ) {
+			gang_add(g, AT45_REQ_WRITE, p->page, p->pages, p->buf,
+				 AT45_FLASH_NO_ERASE);
+			continue;
+		}
+
+		for (page = start = p->page; page <= end; ++page) {
+			if (page < end && g->differ[page / 8] & 1 << page % 8)
+				continue;
+			if (page > start) {
+				gang_add(g, AT45_REQ_WRITE, start, page - start,
+					 p->buf + (size_t)(start - p->page) *
+						  page_sz, 0);
+			}
+			start = page + 1;
+		}
+	}
+
+	for (i = 0; i < g->n_parts; ++i) {
+		gang_add(g, AT45_REQ_VERIFY, g->part[i].page,
+			 g->part[i].pages, g->part[i].buf, 0);
+	}
+
+	for (i = 0; i < g->n_reqs; ++i) {
+		g->rc = at45_submit(q, &g->reqs[i]);
+		if (g->rc) {
+			g->failed = "program";
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/* Account for a completed request of `g`, and go on once probed */
+void gang_done(struct at45_queue *q, struct gang_dev *g,
+	       const struct at45_req *req)
+{
+	bool probe = req >= g->probe && req < g->probe + GANG_PARTS;
+
+	if (req->result < 0) {
+		if (!g->failed) {
+			g->failed = req->op == AT45_REQ_VERIFY && !probe ?
+				    "verify" : "program";
+			g->rc = req->result;
+		}
+	}
+	else if (req->op == AT45_REQ_BLANK) {
+		g->blank = req->result;
+	}
+	else if (req->op == AT45_REQ_WRITE) {
+		g->rc += req->result;
+	}
+	else if (req->op == AT45_REQ_VERIFY && !probe) {
+		g->mismatches += req->result;
+	}
+
+	if (probe && !--g->probing && !g->failed)
+		gang_program(q, g);
+}
+
+/*
+ * Program and verify all devices on one bus. They share a request
+ * queue, so only one message is on the bus at a time while their
+ * erases and programs run side by side.
+ */
+void *gang_bus_thread(void *arg)
+{
+	struct at45_queue *q = at45_queue_new();
+	struct at45_req *done[GANG_REAP];
+	struct gang_dev *g;
+	unsigned int i;
+	int rc;
+
+	for (g = arg; g; g = g->next) {
+		g->failed = "open";
+		g->rc = at45_open(&g->dev, g->name, &g->conf);
+		if (g->rc)
+			continue;
+
+		g->chip = at45_chip(g->dev);
+		at45_set_stream_status(g->dev, g->stream_status);
+
+		if (!q) {
+			g->failed = "program";
+			g->rc = -ENOMEM;
+			continue;
+		}
+		if (gang_probe(q, g))
+			continue;
+
+		g->failed = NULL;
+		g->rc = 0;
+		if (!g->probing)
+			gang_program(q, g);
+	}
+
+	while (q && (rc = at45_reap(q, done, ARRAY_SZ(done), 1)) > 0) {
+		for (i = 0; i < (unsigned int)rc; ++i)
+			gang_done(q, done[i]->user, done[i]);
+	}
+	at45_queue_free(q);
+
+	for (g = arg; g; g = g->next) {
+		if (!g->failed && g->mismatches) {
+			g->failed = "verify";
+			g->rc = g->mismatches;
+		}
+		if (g->dev) {
+			at45_get_stats(g->dev, &g->stats);
+			rc = at45_close(g->dev);
+			if (rc && !g->failed) {
+				g->failed = "close";
+				g->rc = rc;
+			}
+		}
+		free(g->reqs);
+		free(g->differ);
+		free(g->edge);
+	}
+
+	return NULL;
+}
+
+/*
+ * Program and verify the image in `path` on all devices in `names` at
+ * once. Devices on different buses are served by threads of their own,
+ * those sharing a bus take turns on it, see gang_bus_thread(). The
+ * image is mapped once and shared by all. Every device gets a line in
+ * the report. `conf` has the command line settings, which override
+ * those of every device.
+ */
+bool gang_run(char *const *names, unsigned int n_devs, const char *path,
+	      uint32_t offset, size_t length, unsigned int mode,
+	      const struct at45_conf *conf, bool stream_status,
+	      bool show_stats)
+{
+	struct gang_dev *gang = calloc(n_devs, sizeof(*gang));
+	struct at45_stats total = { 0 };
+	unsigned int i, j, n_buses = 0, good = 0;
+	const uint8_t *data = NULL;
+	size_t len, map_len = 0;
+	int rc;
+
+	if (!gang) {
+		perror(__func__);
+		return true;
+	}
+
+	data = map_file(path, &map_len);
+	if (!data)
+		goto out;
+
+	len = map_len;
+	if (length && length < len)
+		len = length;
+
+	for (i = 0; i < n_devs; ++i) {
+		struct gang_dev *g = &gang[i];
+
+		g->name = names[i];
+		g->conf = (struct at45_conf){ SPI_SPEED_HZ, false };
+		if (load_conf(names[i], &g->conf))
+			goto out;
+		if (conf->max_hz)
+			g->conf.max_hz = conf->max_hz;
+		if (conf->low_power)
+			g->conf.low_power = true;
+		g->stream_status = stream_status;
+		g->data = data;
+		g->offset = offset;
+		g->len = len;
+		g->mode = mode;
+
+		rc = at45_bus_name(names[i], g->bus, sizeof(g->bus));
+		if (rc) {
+			printf("%s: %s\n", names[i], strerror(-rc));
+			goto out;
+		}
+
+		/* Chain to the last device found on the same bus */
+		g->first = true;
+		for (j = i; j-- > 0;) {
+			if (!strcmp(gang[j].bus, g->bus)) {
+				gang[j].next = g;
+				g->first = false;
+				break;
+			}
+		}
+	}
+
+
+	for (i = 0; i < n_devs; ++i)
+		n_buses += gang[i].first;
+	printf("Programming %zu bytes on %u devices, %u buses\n", len, n_devs,
+	       n_buses);
+
+	for (i = 0; i < n_devs; ++i) {
+		struct gang_dev *g;
+
+		if (!gang[i].first)
+			continue;
+		errno = pthread_create(&gang[i].thread, NULL, gang_bus_thread,
+				       &gang[i]);
+		if (!errno) {
+			gang[i].started = true;
+			continue;
+		}
+		for (g = &gang[i]; g; g = g->next) {
+			g->failed = "start";
+			g->rc = -errno;
+		}
+	}
+
+	for (i = 0; i < n_devs; ++i) {
+		if (gang[i].started)
+			pthread_join(gang[i].thread, NULL);
+	}
+
+	for (i = 0; i < n_devs; ++i) {
+		struct gang_dev *g = &gang[i];
+
+		if (!g->failed) {
+			printf("%s: %s, %d pages programmed, verified in %.3f s\n",
+			       g->name, g->chip->name, g->rc,
+			       g->stats.us / 1000000.0);
+			good++;
+		}
+		else if (!strcmp(g->failed, "verify") && g->rc > 0) {
+			printf("%s: Failed to verify, %d pages differ\n",
+			       g->name, g->rc);
+		}
+		else if (g->rc == -ENODEV) {
+			printf("%s: No supported chips found\n", g->name);
+		}
+		else {
+			printf("%s: Failed to %s: %s\n", g->name, g->failed,
+			       strerror(-g->rc));
+		}
+
+		total.ioctls += g->stats.ioctls;
+		total.bytes += g->stats.bytes;
+		total.sleeps += g->stats.sleeps;
+		if (g->stats.us > total.us)
+			total.us = g->stats.us;
+	}
+
+	printf("Programmed %u of %u devices\n", good, n_devs);
+	if (show_stats) {
+		printf("Stats: %lu ioctls, %lu bytes, %lu sleeps, %llu us\n",
+		       total.ioctls, total.bytes, total.sleeps,
+		       (unsigned long long)total.us);
+	}
+
+out:
+	if (data)
+		unmap_file(data, map_len);
+	free(gang);
+	return good < n_devs;
+}
+
+int main(int argc, char *argv[])
+{
+	struct at45_dev *dev = NULL;
+	const struct chip *chip;
 	int ret = EXIT_FAILURE;
-	int id;
 	int i;
 	int opt;
 	char *devname = DEFAULT_SPIDEV; /* Default is SPI0 CS0 */
 	int pagesize = 0; /* Don't set page size by default */
-	bool show_status;
+	bool show_status = false;
+	char *read_file = NULL;
+	uint32_t offset = 0;
+	size_t length = 0; /* Up to the end of the chip */
+	int read_fd = -1;
+	char *write_file = NULL;
+	unsigned int mode = 0; /* at45_write() mode */
+	bool show_plan = false;
+	bool do_erase = false;
+	bool show_stats = false;
+	bool stream_status = false;
+	char *verify_file = NULL;
+	char *update_file = NULL;
+	bool blank_check = false;
+	struct at45_conf conf = { SPI_SPEED_HZ, false };
+	uint32_t max_hz = 0; /* From the configuration by default */
+	bool low_power = false;
+	bool tune_clock = false;
+	glob_t devnames = { 0 }; /* Every -d, shell patterns expanded */
+	char *daemon_path = NULL;
+	char *client_path = NULL;
+	struct at45d_client client = { -1 };
+	unsigned int page_sz = 0;
 	struct option options[] = {
 
 		{ "spidev", true, NULL, 'd' },
 		{ "pagesize", true, NULL, 'p' },
 		{ "status", false, NULL, 's' },
+		{ "read", true, NULL, 'r' },
+		{ "offset", true, NULL, 'o' },
+		{ "length", true, NULL, 'l' },
+		{ "write", true, NULL, 'w' },
+		{ "no-erase", false, NULL, 'n' },
+		{ "erase", false, NULL, 'E' },
+		{ "plan", false, NULL, 'P' },
+		{ "verify", true, NULL, 'V' },
+		{ "update", true, NULL, 'u' },
+		{ "blank-check", false, NULL, 'B' },
+		{ "stream-status", false, NULL, 'S' },
+		{ "max-speed", true, NULL, 'm' },
+		{ "low-power", false, NULL, 'L' },
+		{ "tune-clock", false, NULL, 'T' },
+		{ "daemon", true, NULL, 'D' },
+		{ "client", true, NULL, 'c' },
+		{ "stats", false, NULL, 't' },
 		{ "help", false, NULL, 'h' },
+		{ 0 }
 
 	};
 
-	while ((opt = getopt_long(argc, argv, "d:p:sh", options, &i)) != -1) {
+	while ((opt = getopt_long(argc, argv, "d:p:sr:o:l:w:nEPV:u:BSm:LTD:c:th", options, &i)) != -1) {
 		switch (opt) {
 		case 'd':
-			devname = optarg;
+			if (glob(optarg, GLOB_NOCHECK |
+				     (devnames.gl_pathc ? GLOB_APPEND : 0),
+				     NULL, &devnames)) {
+				printf("Failed to expand %s\n", optarg);
+				goto out;
+			}
 			break;
 		case 'p':
 			if (!strcmp(optarg, "256")) {
-				pagesize = AT45_PAGE_256;
+				pagesize = 256;
 			}
 			else {
-				pagesize = AT45_PAGE_264;
+				pagesize = 264;
 			}
 			break;
 		case 's':
 			show_status = true;
 			break;
+		case 'r':
+			read_file = optarg;
+			break;
+		case 'o':
+			offset = strtoul(optarg, NULL, 0);
+			break;
+		case 'l':
+			length = strtoul(optarg, NULL, 0);
+			break;
+		case 'w':
+			write_file = optarg;
+			break;
+		case 'n':
+			mode |= AT45_FLASH_NO_ERASE;
+			break;
+		case 'E':
+			do_erase = true;
+			break;
+		case 'P':
+			show_plan = true;
+			break;
+		case 'V':
+			verify_file = optarg;
+			break;
+		case 'u':
+			update_file = optarg;
+			break;
+		case 'B':
+			blank_check = true;
+			break;
+		case 'S':
+			stream_status = true;
+			break;
+		case 'm':
+			max_hz = strtoul(optarg, NULL, 0);
+			break;
+		case 'L':
+			low_power = true;
+			break;
+		case 'T':
+			tune_clock = true;
+			break;
+		case 'D':
+			daemon_path = optarg;
+			break;
+		case 'c':
+			client_path = optarg;
+			break;
+		case 't':
+			show_stats = true;
+			break;
 		case 'h':
 			ret = EXIT_SUCCESS;
 			/* fall through */
@@ -165,60 +1286,371 @@ int main(int argc, char *argv[])
 			printf("\tOptions:\n");
 			printf("\t\t--spidev, -d <device>  - Use <device>, default is %s\n",
 			       DEFAULT_SPIDEV);
+			printf("\t\t                         Repeat or use a pattern (quoted) to --write or\n");
+			printf("\t\t                         --update several devices at once\n");
+			printf("\t\t                         %s[<file>][,vclock] is an emulated AT45DB041E\n",
+			       EMU_PREFIX);
+			printf("\t\t--read, -r <file>      - Dump the array to <file> (- for stdout)\n");
+			printf("\t\t--write, -w <file>     - Program <file> into the array\n");
+			printf("\t\t--no-erase, -n         - Program without erasing (array must be erased)\n");
+			printf("\t\t--erase, -E            - Erase the array\n");
+			printf("\t\t--plan, -P             - Only show how the array would be erased and programmed\n");
+			printf("\t\t--verify, -V <file>    - Compare the array with <file> on chip\n");
+			printf("\t\t--update, -u <file>    - Program only the pages that differ from <file>\n");
+			printf("\t\t--blank-check, -B      - Check that the array is erased\n");
+			printf("\t\t--stream-status, -S    - Wait for the device by streaming the status register\n");
+			printf("\t\t--max-speed, -m <Hz>   - Clock the bus at most at <Hz>, default is %u\n",
+			       SPI_SPEED_HZ);
+			printf("\t\t--low-power, -L        - Read with the Low Power Read command\n");
+			printf("\t\t--tune-clock, -T       - Find the fastest clock that reads the array range\n");
+			printf("\t\t                         reliably and save it as the device's --max-speed\n");
+			printf("\t\t                         Defaults for a device can be set in %s\n",
+			       AT45_CONF);
+			printf("\t\t--daemon, -D <socket>  - Keep the devices given with -d open and serve\n");
+			printf("\t\t                         requests from --client on <socket>\n");
+			printf("\t\t--client, -c <socket>  - Ask the daemon listening on <socket> to do\n");
+			printf("\t\t                         --status/--pagesize/--erase/--write/--update/\n");
+			printf("\t\t                         --verify/--read\n");
+			printf("\t\t--stats, -t            - Show bus usage statistics\n");
+			printf("\t\t--offset, -o <bytes>   - Start at <bytes> from the beginning of the array\n");
+			printf("\t\t--length, -l <bytes>   - Process <bytes> only, default is up to the end\n");
 			printf("\t\t--help, -h             - Show this help\n");
 			goto out;
 		}
 	}
 
-	printf("Using device %s\n", devname);
-	fd = open(devname, O_RDWR);
-	if (fd < 0) {
-		perror("open");
+	if (!devnames.gl_pathc &&
+	    glob(devname, GLOB_NOCHECK, NULL, &devnames)) {
+		printf("Failed to expand %s\n", devname);
 		goto out;
 	}
+	devname = devnames.gl_pathv[devnames.gl_pathc - 1];
 
-	id = get_jedec_id(fd);
+	if (devnames.gl_pathc > 1 && !daemon_path) {
+		if (!write_file == !update_file || pagesize || show_status ||
+		    read_file || verify_file || do_erase || blank_check ||
+		    tune_clock || client_path || show_plan) {
+			printf("Only --write or --update, which verify as well, and --daemon\n"
+			       "support several devices\n");
+			goto out;
+		}
+		conf.max_hz = max_hz;
+		conf.low_power = low_power;
+		if (!gang_run(devnames.gl_pathv, devnames.gl_pathc,
+			      write_file ? write_file : update_file, offset,
+			      length, write_file ? mode : mode | AT45_FLASH_UPDATE,
+			      &conf, stream_status, show_stats))
+			ret = EXIT_SUCCESS;
+		goto out;
+	}
 
-	for (i = 0; chips[i].name; ++i) {
-		printf("Checking %s...\n", chips[i].name);
-		if (chips[i].jedec_id == id) {
-			printf("Found %s\n", chips[i].name);
-			break;
+	if (read_file) {
+		if (!strcmp(read_file, "-")) {
+			/* Keep stdout for data, send messages to stderr */
+			read_fd = dup(STDOUT_FILENO);
+			dup2(STDERR_FILENO, STDOUT_FILENO);
+		}
+		else {
+			/* Read access lets the dump map the file */
+			read_fd = open(read_file, O_RDWR | O_CREAT | O_TRUNC,
+				       0644);
+		}
+		if (read_fd < 0) {
+			perror(read_file);
+			goto out;
 		}
 	}
 
-	if (!chips[i].name) {
-		printf("No supported chips found (id = 0x%08X)\n", id);
+	if (daemon_path) {
+		if (!at45d_run(daemon_path, devnames.gl_pathv,
+			       devnames.gl_pathc))
+			ret = EXIT_SUCCESS;
 		goto out;
 	}
 
+	if (client_path) {
+		if (blank_check || tune_clock || show_stats || show_plan) {
+			printf("Only --status, --pagesize, --erase, --write, --update, --verify\n"
+			       "and --read are supported with --client\n");
+			goto out;
+		}
+		if (at45d_connect(&client, client_path, devname))
+			goto out;
+		chip = chip_find(client.info.jedec_id);
+		if (!chip) {
+			printf("No supported chips found (id = 0x%08X)\n",
+			       client.info.jedec_id);
+			goto out;
+		}
+		page_sz = client.info.page_sz;
+		goto ops;
+	}
+
+	if (load_conf(devname, &conf))
+		goto out;
+	if (max_hz)
+		conf.max_hz = max_hz;
+	if (low_power)
+		conf.low_power = true;
+
+	printf("Using device %s\n", devname);
+	dev = open_dev(devname, &conf);
+	if (!dev)
+		goto out;
+
+	chip = at45_chip(dev);
+	printf("Found %s\n", chip->name);
+
+	at45_set_stream_status(dev, stream_status);
+	page_sz = at45_page_size(dev);
+	printf("Reading with %02Xh at %u Hz\n", at45_read_opcode(dev),
+	       at45_read_hz(dev));
+
+ops:
 	if (pagesize) {
-		bool err;
-		err = at45_set_page_sz(fd, pagesize);
-		if (err) {
-			printf("Failed to set page size\n");
+		int rc;
+
+		if (client.fd >= 0) {
+			rc = at45d_call(&client, AT45D_PAGE_SZ, pagesize, 0, 0,
+					NULL, NULL);
+			page_sz = pagesize == 256 ? chip->binary_page_sz
+						  : chip->page_sz;
+		}
+		else {
+			rc = at45_set_page_size(dev, pagesize == 256);
+			page_sz = at45_page_size(dev);
+		}
+		if (rc < 0) {
+			report_failure("set page size", rc);
 			goto out;
 		}
-		/* Wait to let subsequent status request show the change */
-		usleep(SPI_CMD_DELAY);
 	}
 
 	if (show_status) {
-		int status = at45_get_status(fd);
+		int status = client.fd >= 0 ?
+			     at45d_call(&client, AT45D_STATUS, 0, 0, 0, NULL,
+					NULL) :
+			     at45_status(dev);
 		if (status < 0) {
-			printf("Failed to get status\n");
+			report_failure("get status", status);
 			goto out;
 		}
 
 		printf("Status: %04X\n", status);
-		for (i = 15; i >= 0; --i) {
+		for (i = chip->features & CHIP_STATUS2 ? 15 : 7; i >= 0; --i) {
 			bool value = (status >> i) & 1;
-			printf("\t[%02d]: %d = %s\n",
-			       i, value, status_bits[i].descr[value]);
+
+			if (i == 5) {
+				print_density(status);
+				i = 2;
+				continue;
+			}
+			printf("\t[%02d]: %d = %s", i, value,
+			       status_bits[i].descr[value]);
+			if (!i)
+				printf(" (%u bytes)", value ? chip->binary_page_sz
+							    : chip->page_sz);
+			printf("\n");
 		}
 	}
 
+	if (tune_clock) {
+		int hz = at45_tune_clock(dev, offset, length, conf.low_power,
+					 tune_step, NULL);
+		int rc;
+
+		if (hz < 0) {
+			report_failure("tune the clock", hz);
+			goto out;
+		}
+
+		conf.max_hz = hz;
+		rc = conf_save(devname, &conf);
+		if (rc) {
+			printf("Failed to save the clock in %s: %s\n",
+			       conf_path(), strerror(-rc));
+			goto out;
+		}
+		printf("Saved %d Hz for %s in %s\n", hz, devname, conf_path());
+	}
+
+	if (do_erase) {
+		size_t len = length;
+		int rc;
+
+		if (!len && offset < (size_t)chip->pages * page_sz)
+			len = (size_t)chip->pages * page_sz - offset;
+
+		rc = client.fd >= 0 ?
+		     at45d_call(&client, AT45D_ERASE, mode, offset, len, NULL,
+				NULL) :
+		     flash(dev, NULL, offset, len, mode, show_plan);
+		if (rc < 0) {
+			report_failure("erase the array", rc);
+			goto out;
+		}
+	}
+
+	if (write_file) {
+		size_t len, map_len;
+		const uint8_t *data = map_file(write_file, &map_len);
+		int rc;
+
+		if (!data)
+			goto out;
+
+		len = map_len;
+		if (length && length < len)
+			len = length;
+
+		rc = client.fd >= 0 ?
+		     at45d_call(&client, AT45D_WRITE, mode, offset, len, data,
+				NULL) :
+		     flash(dev, data, offset, len, mode, show_plan);
+		unmap_file(data, map_len);
+		if (rc < 0) {
+			report_failure("program the array", rc);
+			goto out;
+		}
+	}
+
+	if (update_file) {
+		size_t len, map_len;
+		const uint8_t *data = map_file(update_file, &map_len);
+		int updated;
+
+		if (!data)
+			goto out;
+
+		len = map_len;
+		if (length && length < len)
+			len = length;
+
+		updated = client.fd >= 0 ?
+			  at45d_call(&client, AT45D_WRITE,
+				     mode | AT45_FLASH_UPDATE, offset, len,
+				     data, NULL) :
+			  flash(dev, data, offset, len,
+				mode | AT45_FLASH_UPDATE, show_plan);
+		unmap_file(data, map_len);
+		if (updated < 0) {
+			report_failure("update the array", updated);
+			goto out;
+		}
+		if (!show_plan)
+			printf("Updated %d pages\n", updated);
+	}
+
+	if (verify_file) {
+		size_t len, map_len;
+		const uint8_t *data = map_file(verify_file, &map_len);
+		uint8_t *mismatch = calloc((chip->pages + 7) / 8, 1);
+		unsigned int page;
+		int mismatches;
+
+		if (!data || !mismatch) {
+			free(mismatch);
+			goto out;
+		}
+
+		len = map_len;
+		if (length && length < len)
+			len = length;
+
+		mismatches = client.fd >= 0 ?
+			     at45d_call(&client, AT45D_VERIFY, 0, offset, len,
+					data, NULL) :
+			     at45_verify(dev, data, offset, len, mismatch);
+		unmap_file(data, map_len);
+		for (page = 0; page < chip->pages; ++page) {
+			if (mismatch[page / 8] & 1 << page % 8)
+				printf("Page %u does not match\n", page);
+		}
+		free(mismatch);
+		if (mismatches < 0) {
+			report_failure("verify the array", mismatches);
+			goto out;
+		}
+		if (mismatches) {
+			printf("Failed to verify the array\n");
+			goto out;
+		}
+		printf("Verified %zu bytes\n", len);
+	}
+
+	if (blank_check) {
+		size_t len = length;
+		unsigned int first, count;
+		int blank;
+
+		if (offset >= (size_t)chip->pages * page_sz) {
+			printf("Offset 0x%X is beyond the end of the chip\n",
+			       offset);
+			goto out;
+		}
+
+		if (!len || len > (size_t)chip->pages * page_sz - offset)
+			len = (size_t)chip->pages * page_sz - offset;
+
+		first = offset / page_sz;
+		count = (offset + len - 1) / page_sz - first + 1;
+
+		blank = at45_blank_check(dev, first, count, NULL, true);
+		if (blank < 0) {
+			report_failure("check the array", blank);
+			goto out;
+		}
+		if ((unsigned int)blank < count) {
+			printf("Page %u is not blank\n", first + blank);
+			goto out;
+		}
+		printf("Blank %u pages\n", count);
+	}
+
+	if (read_file && client.fd >= 0) {
+		size_t chip_sz = (size_t)chip->pages * page_sz;
+		size_t len = length;
+		uint8_t *data = NULL;
+		int rc;
+
+		if (offset < chip_sz && (!len || len > chip_sz - offset))
+			len = chip_sz - offset;
+
+		rc = at45d_call(&client, AT45D_READ, 0, offset, len, NULL,
+				&data);
+		if (!rc && write_full(read_fd, data, len))
+			rc = -errno;
+		free(data);
+		if (rc < 0) {
+			report_failure("read the array", rc);
+			goto out;
+		}
+	}
+	else if (read_file) {
+		int rc = at45_dump(dev, read_fd, offset, length);
+
+		if (rc) {
+			report_failure("read the array", rc);
+			goto out;
+		}
+	}
+
+	if (show_stats) {
+		struct at45_stats stats;
+
+		at45_get_stats(dev, &stats);
+		printf("Stats: %lu ioctls, %lu bytes, %lu sleeps, %llu us\n",
+		       stats.ioctls, stats.bytes, stats.sleeps,
+		       (unsigned long long)stats.us);
+	}
+
 	ret = EXIT_SUCCESS;
 out:
+	if (client.fd >= 0)
+		close(client.fd);
+	if (close_dev(devname, dev))
+		ret = EXIT_FAILURE;
+	if (devnames.gl_pathc)
+		globfree(&devnames);
 	return ret;
 }
@@ -0,0 +1,194 @@
+/*
+ * Copyright (C) 2019 Alexander Amelkin <alexander@amelkin.msk.ru>
+ *
+ * libat45: AT45 DataFlash access through spidev or the emulator.
+ *
+ * Every device is used through its own handle, which holds the SPI
+ * transport, the chip, the clocks, the page size and the bus usage
+ * counters. Handles share no mutable state, so different threads may
+ * use different handles at the same time; a handle itself must not be
+ * used by several threads at once. Functions return 0 or a count on
+ * success and a negative errno value on failure, and print nothing.
+ */
+
+#ifndef AT45_H
+#define AT45_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "chips.h"
+#include "config.h"
+#include "plan.h"
+
+/* Only the at45_ API is exported from the shared library */
+#pragma GCC visibility push(default)
+
+#define AT45_STATUS_BINARY_PAGE (1 << 0)
+#define AT45_STATUS_COMP (1 << 6)
+#define AT45_STATUS_READY (1 << 7)
+#define AT45_STATUS_EPE (1 << 13)
+
+/* at45_write() modes */
+#define AT45_FLASH_UPDATE (1 << 0) /* Only change pages that differ */
+#define AT45_FLASH_NO_ERASE (1 << 1) /* The area is erased already */
+
+struct at45_dev;
+
+/* Bus usage counters */
+struct at45_stats {
+	unsigned long ioctls;
+	unsigned long bytes;
+	unsigned long sleeps;
+	uint64_t us; /* Since the device was opened */
+};
+
+/*
+ * Name the SPI controller device `name` is attached to into `bus`.
+ * Devices on the same controller share its bus and cannot transfer at
+ * the same time; devices on different ones can. The controller is
+ * looked up in sysfs, or taken from a /dev/spidevB.C name; emulators
+ * are on a bus of their own unless given bus=<n>.
+ */
+int at45_bus_name(const char *name, char *bus, size_t size);
+
+/*
+ * Open spidev node `name`, or the emulator if it starts with
+ * EMU_PREFIX, and probe the chip. The clocks are set up for `conf`,
+ * or for the configuration file's settings if it is NULL. Returns
+ * -ENODEV if no supported chip answers.
+ */
+int at45_open(struct at45_dev **dev, const char *name,
+	      const struct at45_conf *conf);
+/* Fails if the emulator could not write its image back */
+int at45_close(struct at45_dev *dev);
+
+const struct chip *at45_chip(const struct at45_dev *dev);
+/* Page size in effect, in bytes */
+unsigned int at45_page_size(const struct at45_dev *dev);
+
+/* Choose the clocks and the read command for a board that allows `max_hz` */
+void at45_set_clock(struct at45_dev *dev, uint32_t max_hz, bool low_power);
+uint32_t at45_read_hz(const struct at45_dev *dev);
+uint8_t at45_read_opcode(const struct at45_dev *dev);
+
+/* Wait for the device by streaming the status register */
+void at45_set_stream_status(struct at45_dev *dev, bool enable);
+void at45_get_stats(const struct at45_dev *dev, struct at45_stats *stats);
+
+/* Status register, 8 or 16 bits depending on the chip */
+int at45_status(struct at45_dev *dev);
+
+/*
+ * Switch to binary ("power of 2") or standard DataFlash page size.
+ * Returns -EOPNOTSUPP if the chip's page size is fixed.
+ */
+int at45_set_page_size(struct at45_dev *dev, bool binary);
+
+int at45_read(struct at45_dev *dev, uint32_t offset, uint8_t *buf,
+	      size_t len);
+
+/* Dump `len` bytes at `offset`, or up to the end if 0, to file `out` */
+int at45_dump(struct at45_dev *dev, int out, uint32_t offset, size_t len);
+
+/*
+ * Bring `len` bytes at `offset` to `data`, or erase them if `data` is
+ * NULL. Returns the number of pages changed.
+ */
+int at45_write(struct at45_dev *dev, const uint8_t *data, uint32_t offset,
+	       size_t len, unsigned int mode);
+
+/* What at45_write() would erase and program, free with at45_plan_free() */
+int at45_plan(struct at45_dev *dev, const uint8_t *data, uint32_t offset,
+	      size_t len, unsigned int mode, struct plan *plan);
+void at45_plan_free(struct plan *plan);
+
+/*
+ * Compare `len` bytes at `offset` with `data` on chip. Returns the
+ * number of mismatching pages, and sets their bits in `mismatch`
+ * (indexed by page number) if it isn't NULL.
+ */
+int at45_verify(struct at45_dev *dev, const uint8_t *data, uint32_t offset,
+		size_t len, uint8_t *mismatch);
+
+/*
+ * Check `count` pages starting at `first`. Returns the number of blank
+ * pages, and sets their bits in `bitmap` if it isn't NULL. With `stop`,
+ * checking ends at the first non-blank page, so the number is also the
+ * index of that page within the range.
+ */
+int at45_blank_check(struct at45_dev *dev, unsigned int first,
+		     unsigned int count, uint8_t *bitmap, bool stop);
+
+/* Called after every step of at45_tune_clock() */
+typedef void at45_tune_cb(void *arg, uint8_t opcode, uint32_t hz, bool good);
+
+/*
+ * Find the fastest clock `len` bytes (64 KiB if 0) at `offset` are read
+ * with reliably, and set the clocks up for it. Returns the clock.
+ */
+int at45_tune_clock(struct at45_dev *dev, uint32_t offset, size_t len,
+		    bool low_power, at45_tune_cb *cb, void *arg);
+
+/*
+ * Asynchronous requests. Requests are queued with at45_submit() and
+ * carried out by at45_reap(), which interleaves the requests of all
+ * devices on the queue: while one device is busy erasing or
+ * programming, the others are served, and a program from one SRAM
+ * buffer overlaps loading the next page into the other. Only one
+ * message is on the bus at a time, so a queue serves devices sharing
+ * a bus (see at45_bus_name()). Requests to the same device complete in
+ * submission order.
+ */
+enum at45_req_op {
+	AT45_REQ_STATUS,	/* result: status register */
+	AT45_REQ_READ,		/* `len` bytes at `offset` into `buf` */
+	AT45_REQ_WRITE,		/* Whole pages from `buf`, result: pages */
+	AT45_REQ_ERASE,		/* Whole pages, result: pages */
+	AT45_REQ_VERIFY,	/* Whole pages with `buf`, result: mismatches */
+	AT45_REQ_BLANK,		/* Whole pages, result: blank ones up to the
+				   first that isn't */
+};
+
+struct at45_req {
+	enum at45_req_op op;
+	struct at45_dev *dev;
+	uint32_t offset;
+	size_t len;
+	void *buf;
+	unsigned int mode; /* AT45_REQ_WRITE: AT45_FLASH_NO_ERASE */
+	uint8_t *mismatch; /* AT45_REQ_VERIFY: bits by page number, or NULL */
+	void *user;
+	int result; /* Set on completion, negative errno on failure */
+
+	/* Private to the queue */
+	struct at45_req *next;
+	unsigned int page; /* Next page to start */
+};
+
+struct at45_queue;
+
+struct at45_queue *at45_queue_new(void);
+/* Requests still queued are dropped */
+void at45_queue_free(struct at45_queue *q);
+
+/*
+ * Queue `req`, which must stay valid until it is reaped. Requests
+ * other than reads have to cover whole pages. Erases use the largest
+ * chip, sector or block erase the range covers where that is faster. A
+ * device may be on one queue only.
+ */
+int at45_submit(struct at45_queue *q, struct at45_req *req);
+
+/*
+ * Run the queue until at least `min` requests have completed or none
+ * is left, and return up to `max` completed ones in `done`. Returns
+ * the number of requests returned.
+ */
+int at45_reap(struct at45_queue *q, struct at45_req **done, unsigned int max,
+	      unsigned int min);
+
+#pragma GCC visibility pop
+
+#endif /* AT45_H */
@@ -0,0 +1,47 @@
+/*
+ * Copyright (C) 2019 Alexander Amelkin <alexander@amelkin.msk.ru>
+ *
+ * Protocol of the at45 daemon (at45 --daemon). Every request is a
+ * struct at45d_req followed by `len` bytes of data for AT45D_OPEN,
+ * AT45D_WRITE and AT45D_VERIFY; every response is a struct at45d_resp
+ * followed by its `len` bytes of data. Both are in host byte order,
+ * the socket is local.
+ */
+
+#ifndef AT45D_H
+#define AT45D_H
+
+#include <stdint.h>
+
+#define AT45D_SOCKET "/run/at45.sock"
+
+enum at45d_op {
+	AT45D_OPEN,	/* Data: device name. Result: device index, data: info */
+	AT45D_STATUS,	/* Result: status register */
+	AT45D_PAGE_SZ,	/* arg: 256 or 264 */
+	AT45D_READ,	/* Response data: `len` bytes at `offset` */
+	AT45D_WRITE,	/* arg: flash mode. Result: pages changed */
+	AT45D_ERASE,	/* arg: flash mode. Result: pages changed */
+	AT45D_VERIFY,	/* Result: mismatching pages */
+};
+
+struct at45d_req {
+	uint8_t op;
+	uint8_t dev; /* Index returned by AT45D_OPEN */
+	uint16_t arg;
+	uint32_t offset;
+	uint32_t len;
+};
+
+struct at45d_resp {
+	int32_t result; /* Negative on failure */
+	uint32_t len;
+};
+
+/* AT45D_OPEN response data */
+struct at45d_info {
+	uint32_t jedec_id;
+	uint32_t page_sz; /* Current page size */
+};
+
+#endif /* AT45D_H */
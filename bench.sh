@@ -0,0 +1,121 @@
+#!/bin/sh
+#
+# Copyright (C) 2019 Alexander Amelkin <alexander@amelkin.msk.ru>
+#
+# Run standard workloads against the emulated AT45DB041E on its virtual
+# clock and report throughput and ioctl counts. The numbers depend only
+# on the code and the datasheet timing model, not on the host.
+#
+
+AT45=${AT45:-./at45}
+CHIP_SZ=540672 # 2048 pages of 264 bytes
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+STATUS=0
+
+# Deterministic pseudo-random image
+LC_ALL=C awk -v n=$CHIP_SZ 'BEGIN {
+	srand(1)
+	for (i = 0; i < n; ++i)
+		printf "%c", int(rand() * 256)
+}' > "$DIR/random.bin"
+
+head -c $CHIP_SZ /dev/zero > "$DIR/zero.bin"
+
+# Same image with one byte changed in every 50th page
+cp "$DIR/random.bin" "$DIR/sparse.bin"
+page=0
+while [ $page -lt 2048 ]; do
+	printf '\125' | dd of="$DIR/sparse.bin" bs=1 seek=$((page * 264 + 7)) \
+		conv=notrunc 2>/dev/null
+	page=$((page + 50))
+done
+
+printf "%-16s %10s %10s %10s %12s\n" \
+	"Workload" "MB/s" "ioctls" "ioctls/MB" "Sim time, s"
+
+# report <name> <payload bytes>, reads at45 --stats output
+report() {
+	awk -v name="$1" -v bytes="$2" '
+		/^Stats:/ {
+			ioctls = $2
+			us = $8
+			mb = bytes / 1048576
+			printf "%-16s %10.3f %10d %10.1f %12.3f\n", name,
+			       mb / (us / 1000000), ioctls, ioctls / mb,
+			       us / 1000000
+		}'
+}
+
+# fail <name>: the workload's row is missing, and the run fails
+fail() {
+	echo "$1: FAILED" >&2
+	cat "$DIR/out" >&2
+	STATUS=1
+}
+
+# check <name> <file> <expected file>, the array contents after a workload
+check() {
+	cmp -s -n $CHIP_SZ "$2" "$3" || {
+		echo "$1: $2 does not match $3" >&2
+		STATUS=1
+	}
+}
+
+# run <name> <payload bytes> <chip image> <at45 options...>
+run() {
+	name=$1
+	bytes=$2
+	image=$3
+	shift 3
+	if "$AT45" -d "emu:$image,vclock" --stats "$@" > "$DIR/out"; then
+		report "$name" "$bytes" < "$DIR/out"
+	else
+		fail "$name"
+	fi
+}
+
+# gang <name> <chips> <emulator options> <at45 options...>, time is the
+# slowest chip's
+gang() {
+	name=$1
+	chips=$2
+	opts=$3
+	shift 3
+	set -- "$@" --stats
+	i=0
+	while [ $i -lt $chips ]; do
+		set -- "$@" -d "emu:$DIR/$name$i.img,vclock$opts"
+		i=$((i + 1))
+	done
+	if "$AT45" "$@" > "$DIR/out"; then
+		report "$name" $((chips * CHIP_SZ)) < "$DIR/out"
+	else
+		fail "$name"
+	fi
+}
+
+"$AT45" -d "emu:$DIR/random.img,vclock" -w "$DIR/random.bin" > "$DIR/out" ||
+	fail "setup"
+run "read" $CHIP_SZ "$DIR/random.img" -r "$DIR/read.bin"
+check "read" "$DIR/read.bin" "$DIR/random.bin"
+run "read-bufsiz64k" $CHIP_SZ "$DIR/random.img,bufsiz=65536" -r /dev/null
+run "read-104mhz" $CHIP_SZ "$DIR/random.img" -r /dev/null -m 104000000
+run "program" $CHIP_SZ "$DIR/program.img" -w "$DIR/random.bin"
+check "program" "$DIR/program.img" "$DIR/random.bin"
+run "program-erased" $CHIP_SZ "$DIR/erased.img" -w "$DIR/random.bin" -n
+run "program-fill" $CHIP_SZ "$DIR/fill.img" -w "$DIR/zero.bin"
+run "program-stream" $CHIP_SZ "$DIR/stream.img" -w "$DIR/random.bin" \
+	--stream-status
+run "verify" $CHIP_SZ "$DIR/random.img" -V "$DIR/random.bin"
+run "update-sparse" $CHIP_SZ "$DIR/random.img" -u "$DIR/sparse.bin"
+check "update-sparse" "$DIR/random.img" "$DIR/sparse.bin"
+run "erase-64k" 65536 "$DIR/random.img" -E -o 4096 -l 65536
+run "erase-pages" 4096 "$DIR/random.img" -E -o 270000 -l 4096
+run "erase-chip" $CHIP_SZ "$DIR/random.img" -E
+run "blank-check" $CHIP_SZ "$DIR/random.img" --blank-check
+gang "gang-program-4" 4 "" -w "$DIR/random.bin"
+gang "gang-bus-4" 4 ",bus=0" -w "$DIR/random.bin"
+check "gang-bus-4" "$DIR/gang-bus-43.img" "$DIR/random.bin"
+
+exit $STATUS
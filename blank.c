@@ -0,0 +1,117 @@
+/*
+ * Copyright (C) 2019 Alexander Amelkin <alexander@amelkin.msk.ru>
+ *
+ * Blank check with SIMD. Every 64 bytes are AND-ed together and tested
+ * for all ones, so a non-blank page is rejected within its first
+ * non-blank 64 bytes. On x86 the AVX2 variant is picked at run time
+ * when the CPU has it, SSE2 is the baseline; NEON is used on ARM.
+ */
+
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include "blank.h"
+
+#define BLANK_STRIDE 64
+
+static bool blank_tail(const uint8_t *data, size_t len)
+{
+	uint64_t word;
+
+	for (; len >= sizeof(word); data += sizeof(word), len -= sizeof(word)) {
+		memcpy(&word, data, sizeof(word));
+		if (word != UINT64_MAX)
+			return false;
+	}
+
+	while (len--) {
+		if (*data++ != 0xFF)
+			return false;
+	}
+
+	return true;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+__attribute__((target("avx2")))
+static bool blank_avx2(const uint8_t *data, size_t len)
+{
+	const __m256i ones = _mm256_set1_epi8(-1);
+
+	for (; len >= BLANK_STRIDE; data += BLANK_STRIDE, len -= BLANK_STRIDE) {
+		__m256i v = _mm256_and_si256(
+			_mm256_loadu_si256((const __m256i *)data),
+			_mm256_loadu_si256((const __m256i *)(data + 32)));
+
+		if (!_mm256_testc_si256(v, ones))
+			return false;
+	}
+
+	return blank_tail(data, len);
+}
+
+__attribute__((target("sse2")))
+static bool blank_sse2(const uint8_t *data, size_t len)
+{
+	const __m128i ones = _mm_set1_epi8(-1);
+
+	for (; len >= BLANK_STRIDE; data += BLANK_STRIDE, len -= BLANK_STRIDE) {
+		__m128i v = _mm_and_si128(
+			_mm_and_si128(_mm_loadu_si128((const __m128i *)data),
+				      _mm_loadu_si128((const __m128i *)(data + 16))),
+			_mm_and_si128(_mm_loadu_si128((const __m128i *)(data + 32)),
+				      _mm_loadu_si128((const __m128i *)(data + 48))));
+
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, ones)) != 0xFFFF)
+			return false;
+	}
+
+	return blank_tail(data, len);
+}
+
+static bool (*blank)(const uint8_t *data, size_t len);
+
+/* Chosen before main(), so threads only ever read the pointer */
+__attribute__((constructor))
+static void blank_init(void)
+{
+	__builtin_cpu_init();
+	blank = __builtin_cpu_supports("avx2") ? blank_avx2 : blank_sse2;
+}
+
+bool mem_blank(const uint8_t *data, size_t len)
+{
+	return blank(data, len);
+}
+
+#elif defined(__ARM_NEON)
+
+bool mem_blank(const uint8_t *data, size_t len)
+{
+	for (; len >= BLANK_STRIDE; data += BLANK_STRIDE, len -= BLANK_STRIDE) {
+		uint8x16x4_t q = vld4q_u8(data);
+		uint64x2_t v = vreinterpretq_u64_u8(
+			vandq_u8(vandq_u8(q.val[0], q.val[1]),
+				 vandq_u8(q.val[2], q.val[3])));
+
+		if ((vgetq_lane_u64(v, 0) & vgetq_lane_u64(v, 1)) != UINT64_MAX)
+			return false;
+	}
+
+	return blank_tail(data, len);
+}
+
+#else
+
+bool mem_blank(const uint8_t *data, size_t len)
+{
+	return blank_tail(data, len);
+}
+
+#endif
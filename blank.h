@@ -0,0 +1,15 @@
+/*
+ * Copyright (C) 2019 Alexander Amelkin <alexander@amelkin.msk.ru>
+ */
+
+#ifndef BLANK_H
+#define BLANK_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* True if all `len` bytes at `data` are 0xFF (erased flash) */
+bool mem_blank(const uint8_t *data, size_t len);
+
+#endif /* BLANK_H */
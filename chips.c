@@ -0,0 +1,152 @@
+/*
+ * Copyright (C) 2019 Alexander Amelkin <alexander@amelkin.msk.ru>
+ *
+ * AT45 DataFlash family. JEDEC IDs are read as 4 little-endian bytes:
+ * manufacturer, device ID 1 and 2, extended device information length.
+ * Timing is typical/maximum from the datasheets.
+ */
+
+#include <stddef.h>
+
+#include "chips.h"
+
+#define ARRAY_SZ(x) (sizeof(x) / sizeof((x)[0]))
+#define MHZ 1000000
+
+#define D_SERIES_READ { \
+	[AT45_READ_LF] = 33 * MHZ, \
+	[AT45_READ_HF] = 66 * MHZ, \
+}
+
+#define E_SERIES_READ { \
+	[AT45_READ_LP] = 15 * MHZ, \
+	[AT45_READ_LF] = 50 * MHZ, \
+	[AT45_READ_HF] = 85 * MHZ, \
+	[AT45_READ_HF2] = 104 * MHZ, \
+}
+
+#define D_SERIES_TIME(ep, p, pe, be, se, ce) { \
+	[AT45_OP_XFR] = { 150, 200 }, \
+	[AT45_OP_EP] = ep, \
+	[AT45_OP_P] = p, \
+	[AT45_OP_PE] = pe, \
+	[AT45_OP_BE] = be, \
+	[AT45_OP_SE] = se, \
+	[AT45_OP_CE] = ce, \
+}
+
+#define E_SERIES_TIME(ep, p, pe, be, se, ce) { \
+	[AT45_OP_XFR] = { 100, 200 }, \
+	[AT45_OP_EP] = ep, \
+	[AT45_OP_P] = p, \
+	[AT45_OP_PE] = pe, \
+	[AT45_OP_BE] = be, \
+	[AT45_OP_SE] = se, \
+	[AT45_OP_CE] = ce, \
+}
+
+#define MS(typ, max) { (typ) * 1000, (max) * 1000 }
+
+static const struct chip chips[] = {
+	{ 0x0000221F, "Atmel AT45DB011D", 512, 264, 256, 8, 128, 1,
+	  CHIP_PAGE_CFG, D_SERIES_READ,
+	  D_SERIES_TIME(MS(14, 35), MS(2, 4), MS(13, 32), MS(30, 75),
+			MS(400, 1300), MS(1600, 4000)) },
+	{ 0x0000231F, "Atmel AT45DB021D", 1024, 264, 256, 8, 128, 2,
+	  CHIP_PAGE_CFG, D_SERIES_READ,
+	  D_SERIES_TIME(MS(14, 35), MS(2, 4), MS(13, 32), MS(30, 75),
+			MS(400, 1300), MS(3000, 8000)) },
+	{ 0x0100231F, "Adesto AT45DB021E", 1024, 264, 256, 8, 128, 1,
+	  CHIP_STATUS2 | CHIP_PAGE_CFG, {
+		/* A single buffer and a slower array than the larger parts */
+		[AT45_READ_LP] = 15 * MHZ,
+		[AT45_READ_LF] = 50 * MHZ,
+		[AT45_READ_HF] = 70 * MHZ,
+		[AT45_READ_HF2] = 85 * MHZ,
+	  },
+	  E_SERIES_TIME(MS(12, 35), MS(2, 3), MS(8, 25), MS(25, 35),
+			MS(400, 1300), MS(4000, 8000)) },
+	{ 0x0000241F, "Atmel AT45DB041D", 2048, 264, 256, 8, 256, 2,
+	  CHIP_PAGE_CFG, D_SERIES_READ,
+	  D_SERIES_TIME(MS(14, 35), MS(2, 4), MS(13, 32), MS(30, 75),
+			MS(700, 1300), MS(5000, 12000)) },
+	{ 0x0100241F, "Adesto AT45DB041E", 2048, 264, 256, 8, 256, 2,
+	  CHIP_STATUS2 | CHIP_PAGE_CFG, E_SERIES_READ,
+	  E_SERIES_TIME(MS(12, 35), MS(2, 3), MS(8, 25), MS(25, 35),
+			MS(700, 1300), MS(10000, 20000)) },
+	{ 0x0000251F, "Atmel AT45DB081D", 4096, 264, 256, 8, 256, 2,
+	  CHIP_PAGE_CFG, D_SERIES_READ,
+	  D_SERIES_TIME(MS(17, 40), MS(3, 6), MS(15, 35), MS(45, 100),
+			MS(1600, 5000), MS(9000, 22000)) },
+	{ 0x0100251F, "Adesto AT45DB081E", 4096, 264, 256, 8, 256, 2,
+	  CHIP_STATUS2 | CHIP_PAGE_CFG, E_SERIES_READ,
+	  E_SERIES_TIME(MS(12, 35), MS(2, 3), MS(8, 25), MS(25, 35),
+			MS(700, 1300), MS(20000, 40000)) },
+	{ 0x0000261F, "Atmel AT45DB161D", 4096, 528, 512, 8, 256, 2,
+	  CHIP_PAGE_CFG, D_SERIES_READ,
+	  D_SERIES_TIME(MS(17, 40), MS(3, 6), MS(15, 35), MS(45, 100),
+			MS(1600, 5000), MS(12000, 27000)) },
+	{ 0x0100261F, "Adesto AT45DB161E", 4096, 528, 512, 8, 256, 2,
+	  CHIP_STATUS2 | CHIP_PAGE_CFG, E_SERIES_READ,
+	  E_SERIES_TIME(MS(15, 35), MS(2, 4), MS(12, 35), MS(30, 75),
+			MS(1400, 2000), MS(25000, 40000)) },
+	{ 0x0001271F, "Atmel AT45DB321D", 8192, 528, 512, 8, 128, 2,
+	  CHIP_PAGE_CFG, D_SERIES_READ,
+	  D_SERIES_TIME(MS(17, 40), MS(3, 6), MS(15, 35), MS(45, 100),
+			MS(1600, 5000), MS(40000, 80000)) },
+	{ 0x0101271F, "Adesto AT45DB321E", 8192, 528, 512, 8, 128, 2,
+	  CHIP_STATUS2 | CHIP_PAGE_CFG, E_SERIES_READ,
+	  E_SERIES_TIME(MS(15, 35), MS(2, 4), MS(12, 35), MS(30, 75),
+			MS(700, 1300), MS(50000, 80000)) },
+	{ 0x0000281F, "Atmel AT45DB642D", 8192, 1056, 1024, 8, 256, 2,
+	  CHIP_PAGE_CFG, D_SERIES_READ,
+	  D_SERIES_TIME(MS(17, 40), MS(3, 6), MS(15, 35), MS(45, 100),
+			MS(5000, 10000), MS(80000, 160000)) },
+	{ 0x0100281F, "Adesto AT45DB641E", 32768, 264, 256, 8, 1024, 2,
+	  CHIP_STATUS2 | CHIP_PAGE_CFG, {
+		[AT45_READ_LP] = 15 * MHZ,
+		[AT45_READ_LF] = 50 * MHZ,
+		[AT45_READ_HF] = 85 * MHZ,
+		[AT45_READ_HF2] = 85 * MHZ,
+		[AT45_READ_DUAL] = 85 * MHZ,
+	  },
+	  E_SERIES_TIME(MS(15, 50), MS(2, 4), MS(12, 35), MS(30, 75),
+			MS(6500, 12000), MS(208000, 400000)) },
+};
+
+/* Open addressing hash of chips[] indices + 1, 0 is an empty slot */
+#define CHIP_HASH_BITS 5
+static unsigned char chip_hash[1 << CHIP_HASH_BITS];
+
+static unsigned int chip_slot(uint32_t jedec_id)
+{
+	return (uint32_t)(jedec_id * 0x9E3779B1U) >> (32 - CHIP_HASH_BITS);
+}
+
+__attribute__((constructor))
+static void chip_hash_init(void)
+{
+	unsigned int i, slot;
+
+	for (i = 0; i < ARRAY_SZ(chips); ++i) {
+		slot = chip_slot(chips[i].jedec_id);
+		while (chip_hash[slot])
+			slot = (slot + 1) % ARRAY_SZ(chip_hash);
+		chip_hash[slot] = i + 1;
+	}
+}
+
+const struct chip *chip_find(uint32_t jedec_id)
+{
+	unsigned int slot = chip_slot(jedec_id);
+
+	while (chip_hash[slot]) {
+		const struct chip *chip = &chips[chip_hash[slot] - 1];
+
+		if (chip->jedec_id == jedec_id)
+			return chip;
+		slot = (slot + 1) % ARRAY_SZ(chip_hash);
+	}
+
+	return NULL;
+}
@@ -0,0 +1,55 @@
+/*
+ * Copyright (C) 2019 Alexander Amelkin <alexander@amelkin.msk.ru>
+ */
+
+#ifndef CHIPS_H
+#define CHIPS_H
+
+#include <stdint.h>
+
+/* Internal operations the host has to wait for */
+enum at45_op {
+	AT45_OP_XFR,	/* Page to buffer transfer/compare */
+	AT45_OP_EP,	/* Page erase and program, configuration write */
+	AT45_OP_P,	/* Page program without erase */
+	AT45_OP_PE,	/* Page erase */
+	AT45_OP_BE,	/* Block erase */
+	AT45_OP_SE,	/* Sector erase */
+	AT45_OP_CE,	/* Chip erase */
+	AT45_OP_MAX
+};
+
+/* Array read commands */
+enum at45_read {
+	AT45_READ_LP,	/* 0x01, low power, no dummy bytes */
+	AT45_READ_LF,	/* 0x03, low frequency, no dummy bytes */
+	AT45_READ_HF,	/* 0x0B, 1 dummy byte */
+	AT45_READ_HF2,	/* 0x1B, 2 dummy bytes */
+	AT45_READ_DUAL,	/* 0x3B, dual output, 1 dummy byte */
+	AT45_READ_MAX
+};
+
+/* Chip features */
+#define CHIP_STATUS2 (1 << 0) /* Second status byte (EPE etc.) */
+#define CHIP_PAGE_CFG (1 << 1) /* Page size can be reconfigured */
+
+struct chip {
+	uint32_t jedec_id;
+	const char *name;
+	unsigned int pages;
+	unsigned int page_sz; /* Standard DataFlash page size */
+	unsigned int binary_page_sz; /* 'Power of 2' page size */
+	unsigned int block_pages;
+	unsigned int sector_pages; /* Sector 0 is split into 0a (1 block) and 0b */
+	unsigned int buffers;
+	unsigned int features;
+	uint32_t read_hz[AT45_READ_MAX]; /* Max clock, 0 if unsupported */
+	struct {
+		unsigned int typ, max; /* Microseconds */
+	} time[AT45_OP_MAX];
+};
+
+/* Constant time lookup by JEDEC ID, NULL if unknown */
+const struct chip *chip_find(uint32_t jedec_id);
+
+#endif /* CHIPS_H */
@@ -0,0 +1,127 @@
+/*
+ * Copyright (C) 2019 Alexander Amelkin <alexander@amelkin.msk.ru>
+ */
+
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "config.h"
+
+#define CONF_DELIM " \t\n"
+
+const char *conf_path(void)
+{
+	const char *path = getenv(AT45_CONF_ENV);
+
+	return path && *path ? path : AT45_CONF;
+}
+
+static bool conf_option(char *opt, struct at45_conf *conf)
+{
+	char *end;
+
+	if (!strncmp(opt, "max-speed=", 10)) {
+		conf->max_hz = strtoul(opt + 10, &end, 0);
+		if (end == opt + 10 || *end || !conf->max_hz)
+			return true;
+	}
+	else if (!strcmp(opt, "low-power"))
+		conf->low_power = true;
+	else
+		return true;
+
+	return false;
+}
+
+int conf_load(const char *dev, struct at45_conf *conf, unsigned int *line)
+{
+	char buf[256], *pos;
+	int rc = 0;
+	FILE *f;
+
+	*line = 0;
+	f = fopen(conf_path(), "r");
+	if (!f)
+		return errno == ENOENT ? 0 : -errno;
+
+	while (!rc && fgets(buf, sizeof(buf), f)) {
+		char *name = strtok_r(buf, CONF_DELIM, &pos);
+		char *opt;
+
+		++*line;
+		if (!name || *name == '#' || strcmp(name, dev))
+			continue;
+
+		while (!rc && (opt = strtok_r(NULL, CONF_DELIM, &pos))) {
+			if (conf_option(opt, conf))
+				rc = -EINVAL;
+		}
+	}
+
+	if (!rc && ferror(f))
+		rc = -EIO;
+	if (!rc)
+		*line = 0;
+	fclose(f);
+	return rc;
+}
+
+int conf_save(const char *dev, const struct at45_conf *conf)
+{
+	const char *path = conf_path();
+	char tmp[PATH_MAX];
+	char buf[256], name[256], *pos;
+	bool bol = true, skip = false;
+	int rc = 0;
+	FILE *in, *out;
+
+	if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int)sizeof(tmp))
+		return -ENAMETOOLONG;
+
+	in = fopen(path, "r");
+	if (!in && errno != ENOENT)
+		return -errno;
+
+	out = fopen(tmp, "w");
+	if (!out) {
+		rc = -errno;
+		goto out;
+	}
+
+	while (in && fgets(buf, sizeof(buf), in)) {
+		size_t len = strlen(buf);
+
+		/* Keep all but the device's line, tokenized as conf_load() does */
+		if (bol) {
+			char *tok;
+
+			strcpy(name, buf);
+			tok = strtok_r(name, CONF_DELIM, &pos);
+			skip = tok && !strcmp(tok, dev);
+		}
+		bol = buf[len - 1] == '\n';
+		if (!skip)
+			fputs(buf, out);
+	}
+
+	/* Don't glue our line onto an unterminated last one */
+	if (!bol && !skip)
+		fputc('\n', out);
+
+	fprintf(out, "%s max-speed=%u%s\n", dev, conf->max_hz,
+		conf->low_power ? " low-power" : "");
+
+	if (fclose(out) || rename(tmp, path)) {
+		rc = -errno;
+		unlink(tmp);
+	}
+
+out:
+	if (in)
+		fclose(in);
+	return rc;
+}
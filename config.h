@@ -0,0 +1,39 @@
+/*
+ * Copyright (C) 2019 Alexander Amelkin <alexander@amelkin.msk.ru>
+ */
+
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define AT45_CONF "/etc/at45.conf"
+#define SPI_SPEED_HZ 40000000 /* Board limit unless configured */
+#define AT45_CONF_ENV "AT45_CONF" /* Overrides the path */
+
+/*
+ * Per-device settings. The configuration file has a line per device:
+ *
+ *	# <device> [max-speed=<Hz>] [low-power]
+ *	/dev/spidev0.0 max-speed=50000000
+ */
+struct at45_conf {
+	uint32_t max_hz; /* Fastest clock the board allows */
+	bool low_power; /* Read with the Low Power Read command */
+};
+
+const char *conf_path(void);
+
+/*
+ * Update `conf` with the settings for `dev`, if any. A missing file
+ * is not an error. Returns 0 or a negative errno value, -EINVAL for an
+ * unknown option, with the number of the offending line in `line`
+ * (0 if the error isn't about a line).
+ */
+int conf_load(const char *dev, struct at45_conf *conf, unsigned int *line);
+
+/* Replace the line for `dev` with `conf`, or add it. Returns -errno. */
+int conf_save(const char *dev, const struct at45_conf *conf);
+
+#endif /* CONFIG_H */
@@ -0,0 +1,542 @@
+/*
+ * Copyright (C) 2019 Alexander Amelkin <alexander@amelkin.msk.ru>
+ *
+ * Software model of an Adesto AT45DB041E DataFlash. It interprets the
+ * byte stream of every chip select cycle the way the device does and
+ * keeps the device busy for the typical duration of each internal
+ * operation, ignoring commands that the device would ignore while busy.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include <time.h>
+#include <unistd.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "chips.h"
+#include "transport.h"
+
+#define EMU_PAGES 2048
+#define EMU_PAGE_SZ 264
+#define EMU_BINARY_PAGE_SZ 256
+#define EMU_BYTE_BITS 9 /* Byte address bits in standard page mode */
+#define EMU_BLOCK_PAGES 8
+#define EMU_SECTOR_PAGES 256
+
+#define EMU_DEFAULT_HZ 500000 /* spidev default max_speed_hz */
+#define EMU_MSG_OVERHEAD_NS 10000 /* Syscall and controller setup */
+#define EMU_BUFSIZ 4096 /* spidev default bufsiz */
+#define EMU_ERROR_INTERVAL 997 /* Bytes per bit error above max_hz */
+#define EMU_CFG_BINARY (1 << 0) /* Image trailer: binary page size */
+
+#define EMU_JEDEC_ID 0x0100241F
+
+static const uint8_t emu_id[] = { 0x1F, 0x24, 0x00, 0x01, 0x00 };
+
+struct emu {
+	struct transport t;
+	const struct chip *chip; /* Typical operation times */
+	char *path;
+	bool vclock;
+	uint64_t vnow; /* Virtual clock, nanoseconds */
+	uint32_t mode; /* SPI_IOC_WR_MODE32 bits */
+	uint32_t max_hz; /* Faster transfers receive garbage, 0 if none */
+	uint8_t mem[EMU_PAGES][EMU_PAGE_SZ];
+	uint8_t buf[2][EMU_PAGE_SZ];
+	bool binary;
+	bool comp; /* Last compare mismatched */
+	bool epe; /* Last erase or program failed */
+	uint64_t busy_until;
+	uint64_t busy_time; /* Total internal operation time */
+	int busy_buf; /* Buffer used by the internal operation or -1 */
+
+	/* Current chip select cycle */
+	bool selected;
+	bool ignore;
+	uint8_t cmd[6];
+	unsigned int pos;
+	unsigned int hdr_len;
+	uint32_t ptr; /* Data phase address */
+};
+
+static uint64_t emu_now_us(struct emu *e)
+{
+	struct timespec ts;
+
+	if (e->vclock)
+		return e->vnow / 1000;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static bool emu_busy(struct emu *e)
+{
+	if (e->busy_until && emu_now_us(e) >= e->busy_until) {
+		e->busy_until = 0;
+		e->busy_buf = -1;
+	}
+
+	return e->busy_until;
+}
+
+static void emu_start_op(struct emu *e, enum at45_op op, int bufn)
+{
+	unsigned int us = e->chip->time[op].typ;
+
+	e->busy_until = emu_now_us(e) + us;
+	e->busy_time += us;
+	e->busy_buf = bufn;
+}
+
+static unsigned int emu_page_sz(struct emu *e)
+{
+	return e->binary ? EMU_BINARY_PAGE_SZ : EMU_PAGE_SZ;
+}
+
+static unsigned int emu_page(struct emu *e, uint32_t addr)
+{
+	return (e->binary ? addr >> 8 : addr >> EMU_BYTE_BITS) % EMU_PAGES;
+}
+
+static unsigned int emu_byte(struct emu *e, uint32_t addr)
+{
+	return e->binary ? addr & 0xFF
+			 : (addr & ((1 << EMU_BYTE_BITS) - 1)) % EMU_PAGE_SZ;
+}
+
+static uint16_t emu_status(struct emu *e)
+{
+	uint16_t status = 0x1C; /* 4-Mbit density */
+	bool ready = !emu_busy(e);
+
+	status |= e->binary << 0;
+	status |= e->comp << 6;
+	status |= ready << 7;
+	status |= e->epe << 13;
+	status |= ready << 15;
+
+	return status;
+}
+
+/* Opcode, address and dummy bytes before the data phase */
+static unsigned int emu_hdr_len(uint8_t opcode)
+{
+	switch (opcode) {
+	case 0x9F:
+	case 0xD7:
+		return 1;
+	case 0x0B:
+	case 0x3B:
+	case 0xD4:
+	case 0xD6:
+		return 5;
+	case 0x1B:
+		return 6;
+	default:
+		return 4;
+	}
+}
+
+/* Commands that the device accepts while busy */
+static bool emu_busy_ok(struct emu *e, uint8_t opcode)
+{
+	switch (opcode) {
+	case 0xD7:
+		return true;
+	case 0x84:
+	case 0xD1:
+	case 0xD4:
+		return e->busy_buf != 0;
+	case 0x87:
+	case 0xD3:
+	case 0xD6:
+		return e->busy_buf != 1;
+	default:
+		return false;
+	}
+}
+
+static uint8_t emu_data(struct emu *e, uint8_t tx)
+{
+	unsigned int page_sz = emu_page_sz(e);
+	unsigned int n = e->pos - e->hdr_len;
+	uint8_t rx = 0xFF;
+
+	switch (e->cmd[0]) {
+	case 0x9F:
+		return n < sizeof(emu_id) ? emu_id[n] : 0;
+	case 0xD7:
+		return emu_status(e) >> (n & 1 ? 8 : 0);
+	case 0x01:
+	case 0x03:
+	case 0x0B:
+	case 0x1B:
+	case 0x3B:
+		/* Continuous read through the whole array */
+		rx = e->mem[e->ptr / page_sz][e->ptr % page_sz];
+		e->ptr = (e->ptr + 1) % (EMU_PAGES * page_sz);
+		break;
+	case 0xD1:
+	case 0xD4:
+	case 0xD3:
+	case 0xD6:
+		rx = e->buf[e->cmd[0] & 2 ? 1 : 0][e->ptr];
+		e->ptr = (e->ptr + 1) % page_sz;
+		break;
+	case 0x84:
+	case 0x87:
+		e->buf[e->cmd[0] == 0x87][e->ptr] = tx;
+		e->ptr = (e->ptr + 1) % page_sz;
+		break;
+	}
+
+	return rx;
+}
+
+/* Start the data phase once the header is complete */
+static void emu_hdr_done(struct emu *e)
+{
+	uint32_t addr = e->cmd[1] << 16 | e->cmd[2] << 8 | e->cmd[3];
+
+	switch (e->cmd[0]) {
+	case 0x01:
+	case 0x03:
+	case 0x0B:
+	case 0x1B:
+	case 0x3B:
+		e->ptr = emu_page(e, addr) * emu_page_sz(e) +
+			 emu_byte(e, addr);
+		break;
+	default:
+		e->ptr = emu_byte(e, addr);
+		break;
+	}
+}
+
+static uint8_t emu_xfer_byte(struct emu *e, uint8_t tx)
+{
+	uint8_t rx;
+
+	if (e->ignore)
+		return 0xFF;
+
+	if (e->pos < e->hdr_len || !e->pos) {
+		if (!e->pos) {
+			e->hdr_len = emu_hdr_len(tx);
+			/* Dual-Output Read is an unknown opcode to parts without it */
+			if ((emu_busy(e) && !emu_busy_ok(e, tx)) ||
+			    (tx == 0x3B && !e->chip->read_hz[AT45_READ_DUAL])) {
+				e->ignore = true;
+				return 0xFF;
+			}
+		}
+		if (e->pos < sizeof(e->cmd))
+			e->cmd[e->pos] = tx;
+		if (++e->pos == e->hdr_len)
+			emu_hdr_done(e);
+		return 0xFF;
+	}
+
+	rx = emu_data(e, tx);
+	e->pos++;
+	return rx;
+}
+
+static void emu_erase(struct emu *e, unsigned int page, unsigned int count,
+		      enum at45_op op)
+{
+	memset(e->mem[page], 0xFF, (size_t)count * EMU_PAGE_SZ);
+	e->epe = false;
+	emu_start_op(e, op, -1);
+}
+
+/* Commands executed on the rising edge of CS */
+static void emu_deselect(struct emu *e)
+{
+	static const uint8_t chip_erase[] = { 0xC7, 0x94, 0x80, 0x9A };
+	static const uint8_t page_cfg[] = { 0x3D, 0x2A, 0x80 };
+	uint32_t addr = e->cmd[1] << 16 | e->cmd[2] << 8 | e->cmd[3];
+	unsigned int page = emu_page(e, addr);
+	unsigned int page_sz = emu_page_sz(e);
+	unsigned int i;
+	int bufn;
+
+	e->selected = false;
+	if (e->ignore || e->pos != e->hdr_len || e->hdr_len != 4)
+		return;
+
+	if (!memcmp(e->cmd, chip_erase, sizeof(chip_erase))) {
+		emu_erase(e, 0, EMU_PAGES, AT45_OP_CE);
+		return;
+	}
+
+	if (!memcmp(e->cmd, page_cfg, sizeof(page_cfg)) &&
+	    (e->cmd[3] == 0xA6 || e->cmd[3] == 0xA7)) {
+		e->binary = e->cmd[3] == 0xA6;
+		emu_start_op(e, AT45_OP_EP, -1);
+		return;
+	}
+
+	switch (e->cmd[0]) {
+	case 0x83: /* Buffer to main memory with erase */
+	case 0x86:
+		bufn = e->cmd[0] == 0x86;
+		memset(e->mem[page], 0xFF, EMU_PAGE_SZ);
+		memcpy(e->mem[page], e->buf[bufn], page_sz);
+		e->epe = false;
+		emu_start_op(e, AT45_OP_EP, bufn);
+		break;
+	case 0x88: /* Buffer to main memory without erase */
+	case 0x89:
+		bufn = e->cmd[0] == 0x89;
+		for (i = 0; i < page_sz; ++i)
+			e->mem[page][i] &= e->buf[bufn][i];
+		e->epe = false;
+		emu_start_op(e, AT45_OP_P, bufn);
+		break;
+	case 0x53: /* Main memory to buffer */
+	case 0x55:
+		bufn = e->cmd[0] == 0x55;
+		memcpy(e->buf[bufn], e->mem[page], page_sz);
+		emu_start_op(e, AT45_OP_XFR, bufn);
+		break;
+	case 0x60: /* Main memory to buffer compare */
+	case 0x61:
+		bufn = e->cmd[0] == 0x61;
+		e->comp = memcmp(e->buf[bufn], e->mem[page], page_sz);
+		emu_start_op(e, AT45_OP_XFR, bufn);
+		break;
+	case 0x81: /* Page erase */
+		emu_erase(e, page, 1, AT45_OP_PE);
+		break;
+	case 0x50: /* Block erase */
+		page -= page % EMU_BLOCK_PAGES;
+		emu_erase(e, page, EMU_BLOCK_PAGES, AT45_OP_BE);
+		break;
+	case 0x7C: /* Sector erase, sector 0 is split into 0a and 0b */
+		if (page < EMU_BLOCK_PAGES)
+			emu_erase(e, 0, EMU_BLOCK_PAGES, AT45_OP_SE);
+		else if (page < EMU_SECTOR_PAGES)
+			emu_erase(e, EMU_BLOCK_PAGES,
+				  EMU_SECTOR_PAGES - EMU_BLOCK_PAGES, AT45_OP_SE);
+		else
+			emu_erase(e, page - page % EMU_SECTOR_PAGES,
+				  EMU_SECTOR_PAGES, AT45_OP_SE);
+		break;
+	}
+}
+
+static int emu_xfer(struct transport *t, struct spi_ioc_transfer *xfer,
+		    unsigned int n)
+{
+	struct emu *e = (struct emu *)t;
+	size_t tx_total = 0, rx_total = 0;
+	int total = 0;
+	unsigned int i;
+	uint32_t j;
+
+	for (i = 0; i < n; ++i) {
+		if (xfer[i].tx_buf)
+			tx_total += xfer[i].len;
+		if (xfer[i].rx_buf)
+			rx_total += xfer[i].len;
+	}
+	if (tx_total > t->bufsiz || rx_total > t->bufsiz) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+
+	if (e->vclock)
+		e->vnow += EMU_MSG_OVERHEAD_NS;
+
+	for (i = 0; i < n; ++i) {
+		const uint8_t *tx = (const uint8_t *)(uintptr_t)xfer[i].tx_buf;
+		uint8_t *rx = (uint8_t *)(uintptr_t)xfer[i].rx_buf;
+
+		if (!e->selected) {
+			e->selected = true;
+			e->ignore = false;
+			e->pos = 0;
+			e->hdr_len = 0;
+		}
+
+		for (j = 0; j < xfer[i].len; ++j) {
+			uint8_t rx_byte = emu_xfer_byte(e, tx ? tx[j] : 0);
+
+			/* Marginal signal integrity: a bit error now and then */
+			if (e->max_hz && xfer[i].speed_hz > e->max_hz &&
+			    j % EMU_ERROR_INTERVAL == EMU_ERROR_INTERVAL - 1)
+				rx_byte ^= 1 << j % CHAR_BIT;
+			if (rx)
+				rx[j] = rx_byte;
+		}
+		total += xfer[i].len;
+
+		/* Dual and quad transfers move 2 or 4 bits per clock */
+		if (e->vclock)
+			e->vnow += 8000000000ULL * xfer[i].len /
+				   (xfer[i].speed_hz ? xfer[i].speed_hz
+						     : EMU_DEFAULT_HZ) /
+				   (xfer[i].rx_nbits > 1 ? xfer[i].rx_nbits :
+				    xfer[i].tx_nbits > 1 ? xfer[i].tx_nbits : 1);
+
+		/* cs_change deselects between transfers, keeps CS at the end */
+		if (!!xfer[i].cs_change == (i + 1 < n))
+			emu_deselect(e);
+	}
+
+	return total;
+}
+
+static void emu_delay(struct transport *t, unsigned int us)
+{
+	struct emu *e = (struct emu *)t;
+
+	if (e->vclock)
+		e->vnow += us * 1000ULL;
+	else
+		usleep(us);
+}
+
+/* The emulated controller supports every mode */
+static int emu_set_mode(struct transport *t, uint32_t bits)
+{
+	struct emu *e = (struct emu *)t;
+
+	e->mode |= bits;
+	return e->mode;
+}
+
+static uint64_t emu_now(struct transport *t)
+{
+	return emu_now_us((struct emu *)t);
+}
+
+static int emu_close(struct transport *t)
+{
+	struct emu *e = (struct emu *)t;
+	int fd, rc = 0;
+
+	if (e->path) {
+		fd = open(e->path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fd < 0) {
+			rc = -1;
+		}
+		else {
+			uint8_t cfg = e->binary ? EMU_CFG_BINARY : 0;
+			struct iovec iov[] = {
+				{ e->mem, sizeof(e->mem) },
+				{ &cfg, sizeof(cfg) },
+			};
+			ssize_t n = writev(fd, iov, 2);
+
+			if (n >= 0 && n != sizeof(e->mem) + sizeof(cfg))
+				errno = ENOSPC;
+			if (n != sizeof(e->mem) + sizeof(cfg))
+				rc = -1;
+			if (close(fd))
+				rc = -1;
+		}
+	}
+
+	free(e->path);
+	free(e);
+	return rc;
+}
+
+uint64_t emu_busy_time(struct transport *t)
+{
+	return ((struct emu *)t)->busy_time;
+}
+
+struct transport *emu_open(const char *spec)
+{
+	struct emu *e = calloc(1, sizeof(*e));
+	char *opt, *next;
+	int fd;
+
+	if (!e)
+		return NULL;
+
+	e->chip = chip_find(EMU_JEDEC_ID);
+	e->t.xfer = emu_xfer;
+	e->t.delay = emu_delay;
+	e->t.now = emu_now;
+	e->t.close = emu_close;
+	e->t.set_mode = emu_set_mode;
+	e->t.bufsiz = EMU_BUFSIZ;
+	e->busy_buf = -1;
+	memset(e->mem, 0xFF, sizeof(e->mem));
+
+	if (spec && *spec) {
+		e->path = strdup(spec);
+		if (!e->path)
+			goto fail;
+		opt = strchr(e->path, ',');
+		if (opt)
+			*opt++ = '\0';
+		for (; opt; opt = next) {
+			next = strchr(opt, ',');
+			if (next)
+				*next++ = '\0';
+			if (!strcmp(opt, "vclock"))
+				e->vclock = true;
+			else if (!strncmp(opt, "bufsiz=", 7))
+				e->t.bufsiz = strtoul(opt + 7, NULL, 0);
+			else if (!strncmp(opt, "maxhz=", 6))
+				e->max_hz = strtoul(opt + 6, NULL, 0);
+			else if (!strncmp(opt, "bus=", 4))
+				; /* Only for at45_bus_name() */
+			else
+				goto bad_opt;
+		}
+		if (!*e->path) {
+			free(e->path);
+			e->path = NULL;
+		}
+	}
+
+	/*
+	 * A missing image is a blank chip, written out on close. The array
+	 * is followed by a byte of the nonvolatile configuration, which
+	 * plain dumps lack.
+	 */
+	if (e->path) {
+		fd = open(e->path, O_RDONLY);
+		if (fd < 0 && errno != ENOENT)
+			goto fail;
+		if (fd >= 0) {
+			uint8_t cfg = 0;
+			struct iovec iov[] = {
+				{ e->mem, sizeof(e->mem) },
+				{ &cfg, sizeof(cfg) },
+			};
+			ssize_t n = readv(fd, iov, 2);
+
+			close(fd);
+			if (n < 0)
+				goto fail;
+			e->binary = cfg & EMU_CFG_BINARY;
+		}
+	}
+
+	return &e->t;
+
+bad_opt:
+	errno = EINVAL;
+fail:
+	free(e->path);
+	free(e);
+	return NULL;
+}
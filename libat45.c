@@ -0,0 +1,2029 @@
+/*
+ * Copyright (C) 2019 Alexander Amelkin <alexander@amelkin.msk.ru>
+ */
+
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/spi/spidev.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+
+#include "at45.h"
+#include "blank.h"
+#include "transport.h"
+
+#define JEDEC_ID_CMD 0x9F
+#define AT45_STATUS_CMD 0xD7
+#define AT45_PAGE_256 0xA6
+#define AT45_PAGE_264 0xA7
+#define AT45_SET_PAGE_SZ 0x3D, 0x2A, 0x80
+#define AT45_BUF_WRITE(b) ((b) ? 0x87 : 0x84) /* Buffer 1/2 Write */
+#define AT45_BUF_PROG_ERASE(b) ((b) ? 0x86 : 0x83) /* With built-in erase */
+#define AT45_BUF_PROG(b) ((b) ? 0x89 : 0x88) /* Without built-in erase */
+#define AT45_PAGE_TO_BUF(b) ((b) ? 0x55 : 0x53) /* Main memory to buffer */
+#define AT45_PAGE_CMP_BUF(b) ((b) ? 0x61 : 0x60) /* Main memory to buffer compare */
+#define AT45_PAGE_ERASE 0x81
+#define AT45_BLOCK_ERASE 0x50
+#define AT45_SECTOR_ERASE 0x7C
+#define AT45_CHIP_ERASE 0xC7, 0x94, 0x80, 0x9A
+
+#define ARRAY_SZ(x) (sizeof(x) / sizeof((x)[0]))
+
+#define SPI_CFG_HZ 20000000 /* ID, status and configuration commands */
+#define SPI_XFER_MAX 4096 /* Default spidev bufsiz */
+#define SPIDEV_BUFSIZ "/sys/module/spidev/parameters/bufsiz"
+#define SPIDEV_CLASS "/sys/class/spidev"
+
+/* at45_tune_clock() */
+#define TUNE_START_HZ 1000000 /* Baseline every board should manage */
+#define TUNE_LEN 65536 /* Bytes read at each step by default */
+#define TUNE_READS 3 /* Reads that have to match at each step */
+#define TUNE_MARGIN 80 /* Percent of the fastest good clock to use */
+
+/*
+ * Internal functions fail like system calls: they return true or -1
+ * with errno set, and the public ones turn that into -errno.
+ */
+#define DEF_SPI_CMD(cmd, snd, rcv) \
+	struct spi_ioc_transfer cmd[2] = { \
+		{ \
+			.tx_buf = (uintptr_t)(snd), \
+			.rx_buf = (uintptr_t)(rcv), \
+			.len = sizeof(snd), \
+			.speed_hz = dev->bus.cfg_hz \
+		} \
+	}
+
+#define DO_XFER(cmd, rval) \
+	if (0 > spi_xfer(dev, (cmd), ARRAY_SZ(cmd))) \
+		return (rval);
+
+/* Array read commands, see enum at45_read */
+static const struct {
+	uint8_t opcode;
+	uint8_t dummy; /* Bytes between the address and the data */
+	uint8_t nbits; /* Data bus width */
+} read_cmds[AT45_READ_MAX] = {
+	[AT45_READ_LP] = { 0x01, 0, 1 },
+	[AT45_READ_LF] = { 0x03, 0, 1 },
+	[AT45_READ_HF] = { 0x0B, 1, 1 },
+	[AT45_READ_HF2] = { 0x1B, 2, 1 },
+	[AT45_READ_DUAL] = { 0x3B, 1, 2 },
+};
+
+/* Clocks and read command, see at45_set_clock() */
+struct at45_bus {
+	uint32_t cfg_hz; /* ID, status, configuration and page commands */
+	uint32_t cmd_hz; /* Buffer writes and programs */
+	uint32_t read_hz;
+	enum at45_read read;
+};
+
+struct at45_dev {
+	struct transport *t;
+	const struct chip *chip;
+	struct at45_bus bus;
+	unsigned int page_sz; /* In effect, kept up to date on changes */
+	bool stream_status;
+	struct at45_stats stats;
+	uint64_t start_us;
+
+	/* Asynchronous requests, see at45_reap() */
+	struct at45_queue *q;
+	struct at45_dev *q_next; /* Next device on the queue */
+	struct at45_req *q_head, *q_tail;
+	enum at45_op busy; /* Internal operation in progress */
+	uint64_t poll_at, deadline;
+	unsigned int backoff;
+	int loaded; /* Buffer holding the next page to program, or -1 */
+};
+
+static int spi_xfer(struct at45_dev *dev, struct spi_ioc_transfer *xfer,
+		    unsigned int n)
+{
+	unsigned int i;
+
+	dev->stats.ioctls++;
+	for (i = 0; i < n; ++i)
+		dev->stats.bytes += xfer[i].len;
+
+	return dev->t->xfer(dev->t, xfer, n);
+}
+
+static void spi_delay(struct at45_dev *dev, unsigned int us)
+{
+	dev->stats.sleeps++;
+	dev->t->delay(dev->t, us);
+}
+
+struct spidev {
+	struct transport t;
+	int fd;
+};
+
+static int spidev_xfer(struct transport *t, struct spi_ioc_transfer *xfer,
+		       unsigned int n)
+{
+	return ioctl(((struct spidev *)t)->fd, SPI_IOC_MESSAGE(n), xfer);
+}
+
+static void spidev_delay(struct transport *t, unsigned int us)
+{
+	(void)t;
+	usleep(us);
+}
+
+static uint64_t spidev_now(struct transport *t)
+{
+	struct timespec ts;
+
+	(void)t;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static int spidev_set_mode(struct transport *t, uint32_t bits)
+{
+	int fd = ((struct spidev *)t)->fd;
+	uint32_t mode;
+
+	if (ioctl(fd, SPI_IOC_RD_MODE32, &mode) < 0)
+		return -1;
+
+	mode |= bits;
+	if (ioctl(fd, SPI_IOC_WR_MODE32, &mode) < 0 ||
+	    ioctl(fd, SPI_IOC_RD_MODE32, &mode) < 0)
+		return -1;
+
+	return mode;
+}
+
+static int spidev_close(struct transport *t)
+{
+	close(((struct spidev *)t)->fd);
+	free(t);
+	return 0;
+}
+
+/* Message size limit of the spidev driver, the default if unknown */
+static size_t spidev_bufsiz(void)
+{
+	unsigned long bufsiz;
+	FILE *f = fopen(SPIDEV_BUFSIZ, "re");
+
+	if (!f)
+		return SPI_XFER_MAX;
+
+	if (fscanf(f, "%lu", &bufsiz) != 1 || !bufsiz)
+		bufsiz = SPI_XFER_MAX;
+	fclose(f);
+
+	return bufsiz;
+}
+
+struct transport *spidev_open(const char *path)
+{
+	struct spidev *dev = calloc(1, sizeof(*dev));
+
+	if (!dev)
+		return NULL;
+
+	dev->fd = open(path, O_RDWR | O_CLOEXEC);
+	if (dev->fd < 0) {
+		free(dev);
+		return NULL;
+	}
+
+	dev->t.xfer = spidev_xfer;
+	dev->t.delay = spidev_delay;
+	dev->t.now = spidev_now;
+	dev->t.close = spidev_close;
+	dev->t.set_mode = spidev_set_mode;
+	dev->t.bufsiz = spidev_bufsiz();
+
+	return &dev->t;
+}
+
+
+/*
+ * Several commands chained into one SPI message. Every command is an
+ * opcode/address header optionally followed by a data transfer; CS is
+ * toggled between commands via cs_change on their last transfer.
+ */
+#define AT45_BATCH_MAX 8 /* Commands */
+
+struct at45_batch {
+	struct spi_ioc_transfer xfer[2 * AT45_BATCH_MAX];
+	uint8_t hdr[AT45_BATCH_MAX][5];
+	unsigned int cmds;
+	unsigned int n;
+	uint32_t speed_hz;
+};
+
+static void at45_batch_init(struct at45_batch *b, uint32_t speed_hz)
+{
+	memset(b, 0, sizeof(*b));
+	b->speed_hz = speed_hz;
+}
+
+/*
+ * Append a command. `hdr_len` bytes of opcode, 24-bit address and dummy
+ * bytes are sent, then `len` bytes are sent from `tx` and/or received
+ * into `rx`.
+ */
+static bool at45_batch_cmd(struct at45_batch *b, uint8_t opcode,
+			   uint32_t addr, unsigned int hdr_len,
+			   const void *tx, void *rx, size_t len)
+{
+	uint8_t *hdr;
+
+	if (b->cmds == AT45_BATCH_MAX) {
+		errno = ENOSPC;
+		return true;
+	}
+
+	hdr = b->hdr[b->cmds++];
+	hdr[0] = opcode;
+	hdr[1] = addr >> 16;
+	hdr[2] = addr >> 8;
+	hdr[3] = addr;
+	hdr[4] = 0;
+
+	b->xfer[b->n].tx_buf = (uintptr_t)hdr;
+	b->xfer[b->n].len = hdr_len;
+	b->xfer[b->n].speed_hz = b->speed_hz;
+	b->n++;
+
+	if (len) {
+		b->xfer[b->n].tx_buf = (uintptr_t)tx;
+		b->xfer[b->n].rx_buf = (uintptr_t)rx;
+		b->xfer[b->n].len = len;
+		b->xfer[b->n].speed_hz = b->speed_hz;
+		b->n++;
+	}
+
+	/* Deselect after the command, unless it's the last one */
+	b->xfer[b->n - 1].cs_change = 1;
+
+	return false;
+}
+
+static bool at45_batch_run(struct at45_dev *dev, struct at45_batch *b)
+{
+	if (!b->n)
+		return false;
+
+	/* cs_change on the last transfer would keep CS asserted */
+	b->xfer[b->n - 1].cs_change = 0;
+
+	return 0 > spi_xfer(dev, b->xfer, b->n);
+}
+
+static bool get_jedec_id(struct at45_dev *dev, uint32_t *id)
+{
+	uint8_t send_data[6] = { JEDEC_ID_CMD };
+	uint8_t recv_data[6] = { 0 };
+	DEF_SPI_CMD(jedec_id, send_data, recv_data);
+	DO_XFER(jedec_id, true);
+
+	*id = *(uint32_t *)(recv_data + 1);
+	return false;
+}
+
+static int at45_get_status(struct at45_dev *dev)
+{
+	uint8_t send_data[3] = { AT45_STATUS_CMD };
+	uint8_t recv_data[3] = { 0 };
+	DEF_SPI_CMD(status, send_data, recv_data);
+	DO_XFER(status, -1);
+
+	/* Chips without a second status byte repeat the first one */
+	if (!(dev->chip->features & CHIP_STATUS2))
+		return recv_data[1];
+	return *(uint16_t *)(recv_data + 1);
+}
+
+static bool at45_set_page_sz(struct at45_dev *dev, uint8_t page_sz)
+{
+	uint8_t send_data[4] = { AT45_SET_PAGE_SZ, 0 };
+	uint8_t recv_data[4] = { 0 }; /* Ignore */
+	DEF_SPI_CMD(set_page_sz, send_data, recv_data);
+	send_data[3] = page_sz;
+	DO_XFER(set_page_sz, true);
+
+	return false;
+}
+
+/* Page size currently in effect according to the device, or 0 on error */
+static unsigned int at45_get_page_sz(struct at45_dev *dev)
+{
+	int status = at45_get_status(dev);
+
+	if (status < 0)
+		return 0;
+
+	if ((dev->chip->features & CHIP_PAGE_CFG) &&
+	    (status & AT45_STATUS_BINARY_PAGE))
+		return dev->chip->binary_page_sz;
+
+	return dev->chip->page_sz;
+}
+
+/*
+ * Convert a linear byte offset into a device address. In standard
+ * DataFlash mode the page number is shifted left past the bits
+ * needed to address a byte within the (non power of 2) page.
+ */
+static uint32_t at45_addr(const struct at45_dev *dev, uint32_t offset)
+{
+	unsigned int page_sz = dev->page_sz;
+	unsigned int byte_bits;
+
+	if (page_sz != dev->chip->page_sz)
+		return offset;
+
+	byte_bits = CHAR_BIT * sizeof(int) - __builtin_clz(page_sz - 1);
+	return (offset / page_sz) << byte_bits | offset % page_sz;
+}
+
+static size_t at45_chip_sz(const struct at45_dev *dev)
+{
+	return (size_t)dev->chip->pages * dev->page_sz;
+}
+
+/*
+ * Read `len` bytes starting at `offset` with the continuous read
+ * command chosen by at45_set_clock(). Each message carries the
+ * opcode/address header and as much data as spidev will accept, so
+ * the whole array takes size/bufsiz calls.
+ */
+int at45_read(struct at45_dev *dev, uint32_t offset, uint8_t *buf,
+	      size_t len)
+{
+	const struct at45_bus *bus = &dev->bus;
+
+	if (offset > at45_chip_sz(dev) || len > at45_chip_sz(dev) - offset)
+		return -EINVAL;
+
+	while (len) {
+		uint32_t addr = at45_addr(dev, offset);
+		size_t chunk = len < dev->t->bufsiz ? len : dev->t->bufsiz;
+		uint8_t send_data[6] = {
+			read_cmds[bus->read].opcode, addr >> 16, addr >> 8,
+			addr, 0, 0
+		};
+		struct spi_ioc_transfer read_cont[2] = {
+			{
+				.tx_buf = (uintptr_t)send_data,
+				.len = 4 + read_cmds[bus->read].dummy,
+				.speed_hz = bus->read_hz
+			},
+			{
+				.rx_buf = (uintptr_t)buf,
+				.len = chunk,
+				.rx_nbits = read_cmds[bus->read].nbits,
+				.speed_hz = bus->read_hz
+			}
+		};
+		DO_XFER(read_cont, -errno);
+
+		offset += chunk;
+		buf += chunk;
+		len -= chunk;
+	}
+
+	return 0;
+}
+
+/*
+ * Enable Dual-Output Read if both the chip and the SPI controller
+ * support it. spidev drops the mode bits the controller lacks, so the
+ * mode read back tells.
+ */
+static bool at45_setup_dual(struct at45_dev *dev)
+{
+	struct transport *t = dev->t;
+	int mode;
+
+	if (!dev->chip->read_hz[AT45_READ_DUAL] || !t->set_mode)
+		return false;
+
+	mode = t->set_mode(t, SPI_RX_DUAL);
+	return mode >= 0 && (mode & SPI_RX_DUAL);
+}
+
+/*
+ * Choose the clock of every kind of command and the read command for
+ * a board that allows `max_hz`. Reads use Dual-Output Read if
+ * possible, otherwise the command with the fewest dummy bytes that
+ * still runs at `max_hz`, or the fastest one the chip has. Everything
+ * else is capped by the chip's clock for commands other than reads.
+ */
+void at45_set_clock(struct at45_dev *dev, uint32_t max_hz, bool low_power)
+{
+	const struct chip *chip = dev->chip;
+	struct at45_bus *bus = &dev->bus;
+	enum at45_read read = AT45_READ_LF;
+	enum at45_read r;
+
+	if (low_power && chip->read_hz[AT45_READ_LP]) {
+		read = AT45_READ_LP;
+	}
+	else if (at45_setup_dual(dev)) {
+		read = AT45_READ_DUAL;
+	}
+	else {
+		for (r = AT45_READ_LF; r <= AT45_READ_HF2; ++r) {
+			if (chip->read_hz[r] > chip->read_hz[read])
+				read = r;
+			if (chip->read_hz[read] >= max_hz)
+				break;
+		}
+	}
+
+	bus->read = read;
+	bus->read_hz = chip->read_hz[read] < max_hz ? chip->read_hz[read]
+						    : max_hz;
+	bus->cmd_hz = chip->read_hz[AT45_READ_HF] < max_hz ?
+		      chip->read_hz[AT45_READ_HF] : max_hz;
+	bus->cfg_hz = SPI_CFG_HZ < max_hz ? SPI_CFG_HZ : max_hz;
+}
+
+uint32_t at45_read_hz(const struct at45_dev *dev)
+{
+	return dev->bus.read_hz;
+}
+
+uint8_t at45_read_opcode(const struct at45_dev *dev)
+{
+	return read_cmds[dev->bus.read].opcode;
+}
+
+/*
+ * Dump into a regular file by reading straight into a shared mapping
+ * of it, preallocated at the current file offset. Returns 1 if the
+ * file can't be mapped (e.g. opened write-only), so the caller falls
+ * back to write().
+ */
+static int at45_dump_mmap(struct at45_dev *dev, int out, uint32_t offset,
+			  size_t len)
+{
+	long map_align = sysconf(_SC_PAGESIZE);
+	off_t pos = lseek(out, 0, SEEK_CUR);
+	off_t base = pos - pos % map_align;
+	size_t map_len = pos - base + len;
+	uint8_t *map;
+	int rc;
+
+	if (pos < 0)
+		return 1;
+
+	/* Filesystems without fallocate() just get a sparse file */
+	if (posix_fallocate(out, pos, len) && ftruncate(out, pos + len))
+		return 1;
+
+	map = mmap(NULL, map_len, PROT_READ | PROT_WRITE, MAP_SHARED, out,
+		   base);
+	if (map == MAP_FAILED)
+		return 1;
+
+	rc = at45_read(dev, offset, map + (pos - base), len);
+	munmap(map, map_len);
+	if (rc)
+		return rc;
+
+	if (lseek(out, pos + len, SEEK_SET) < 0)
+		return -errno;
+
+	return 0;
+}
+
+/*
+ * Dump into a pipe by reading into page-aligned chunks and splicing
+ * the user pages into the pipe. The pipe references the pages instead
+ * of copying them, and so may whatever the reader splices them on to,
+ * for as long as it likes: every chunk is freshly mapped, gifted to
+ * the pipe and unmapped, never written again.
+ */
+static int at45_dump_splice(struct at45_dev *dev, int out, uint32_t offset,
+			    size_t len)
+{
+	size_t chunk_sz = dev->t->bufsiz;
+	int rc = 0;
+
+	if (fcntl(out, F_GETPIPE_SZ) < 0)
+		return 1;
+
+	while (len) {
+		size_t chunk = len < chunk_sz ? len : chunk_sz;
+		struct iovec iov;
+		uint8_t *buf;
+
+		buf = mmap(NULL, chunk, PROT_READ | PROT_WRITE,
+			   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (buf == MAP_FAILED)
+			return -errno;
+
+		iov = (struct iovec){ buf, chunk };
+		rc = at45_read(dev, offset, buf, chunk);
+		while (!rc && iov.iov_len) {
+			ssize_t n = vmsplice(out, &iov, 1, SPLICE_F_GIFT);
+
+			if (n < 0) {
+				rc = -errno;
+				break;
+			}
+			iov.iov_base = (uint8_t *)iov.iov_base + n;
+			iov.iov_len -= n;
+		}
+
+		munmap(buf, chunk);
+		if (rc)
+			return rc;
+
+		offset += chunk;
+		len -= chunk;
+	}
+
+	return 0;
+}
+
+static int at45_dump_write(struct at45_dev *dev, int out, uint32_t offset,
+			   size_t len)
+{
+	size_t chunk_sz = dev->t->bufsiz;
+	uint8_t *buf;
+	int rc = 0;
+
+	buf = malloc(chunk_sz);
+	if (!buf)
+		return -ENOMEM;
+
+	while (len) {
+		size_t chunk = len < chunk_sz ? len : chunk_sz;
+
+		rc = at45_read(dev, offset, buf, chunk);
+		if (rc)
+			goto out;
+
+		if (write(out, buf, chunk) != (ssize_t)chunk) {
+			rc = -errno;
+			goto out;
+		}
+
+		offset += chunk;
+		len -= chunk;
+	}
+
+out:
+	free(buf);
+	return rc;
+}
+
+/*
+ * Dump the array range to the `out` file descriptor. Data is received
+ * straight into the file's page cache for regular files, or spliced
+ * into pipes, so only other outputs pay for a copy.
+ */
+int at45_dump(struct at45_dev *dev, int out, uint32_t offset, size_t len)
+{
+	size_t chip_sz = at45_chip_sz(dev);
+	struct stat st;
+	int rc = 1;
+
+	if (offset >= chip_sz)
+		return -EINVAL;
+
+	if (!len || len > chip_sz - offset)
+		len = chip_sz - offset;
+
+	if (fstat(out, &st))
+		return -errno;
+
+	if (S_ISREG(st.st_mode))
+		rc = at45_dump_mmap(dev, out, offset, len);
+	else if (S_ISFIFO(st.st_mode))
+		rc = at45_dump_splice(dev, out, offset, len);
+
+	if (rc > 0)
+		rc = at45_dump_write(dev, out, offset, len);
+
+	return rc;
+}
+
+/*
+ * Read the status register continuously for `len` bytes within a
+ * single transfer. The device keeps clocking out both status bytes for
+ * as long as CS is asserted, so the whole window costs one ioctl.
+ * Parts without the second status byte repeat the first one only.
+ * Returns the first status word showing RDY, or the last one seen.
+ */
+static int at45_stream_status(struct at45_dev *dev, size_t len)
+{
+	size_t step = dev->chip->features & CHIP_STATUS2 ? 2 : 1;
+	uint8_t send_data[1] = { AT45_STATUS_CMD };
+	uint8_t recv_data[SPI_XFER_MAX];
+	struct spi_ioc_transfer status[2] = {
+		{
+			.tx_buf = (uintptr_t)send_data,
+			.len = sizeof(send_data),
+			.speed_hz = dev->bus.cfg_hz
+		},
+		{
+			.rx_buf = (uintptr_t)recv_data,
+			.len = len < 2 ? 2 :
+			       len > sizeof(recv_data) ? sizeof(recv_data) :
+			       len > dev->t->bufsiz ? dev->t->bufsiz & ~1 :
+			       len & ~1,
+			.speed_hz = dev->bus.cfg_hz
+		}
+	};
+	size_t i;
+
+	DO_XFER(status, -1);
+
+	for (i = 0; i + step < status[1].len; i += step) {
+		if (recv_data[i] & AT45_STATUS_READY)
+			break;
+	}
+
+	if (step == 1)
+		return recv_data[i];
+
+	return recv_data[i] | recv_data[i + 1] << CHAR_BIT;
+}
+
+/*
+ * Wait for the device to finish operation `op`. Sleep for the typical
+ * operation time first, then poll RDY/BUSY with a short backoff that
+ * grows up to a quarter of the typical time, or with growing status
+ * streaming windows. Erase and program results are checked through
+ * the EPE bit. Returns the final status, or -1 on error: ETIMEDOUT if
+ * the device stays busy, EIO if the operation failed.
+ */
+static int at45_wait_status(struct at45_dev *dev, enum at45_op op)
+{
+	const struct chip *chip = dev->chip;
+	struct transport *t = dev->t;
+	unsigned int typ = chip->time[op].typ;
+	unsigned int delay = typ / 16 ? typ / 16 : 10;
+	uint64_t deadline = t->now(t) + 2 * chip->time[op].max;
+	/* A few status samples first, the transfer can't end early */
+	size_t window = 16;
+	int status;
+
+	spi_delay(dev, typ);
+	for (;;) {
+		status = dev->stream_status ? at45_stream_status(dev, window)
+					    : at45_get_status(dev);
+		if (status < 0)
+			return -1;
+
+		if (status & AT45_STATUS_READY)
+			break;
+
+		if (t->now(t) > deadline) {
+			errno = ETIMEDOUT;
+			return -1;
+		}
+
+		if (dev->stream_status) {
+			/* The transfer itself is the delay */
+			if (window < SPI_XFER_MAX && window < t->bufsiz)
+				window *= 2;
+			continue;
+		}
+
+		spi_delay(dev, delay);
+		if (delay < typ / 4)
+			delay *= 2;
+	}
+
+	if (op != AT45_OP_XFR && (chip->features & CHIP_STATUS2) &&
+	    (status & AT45_STATUS_EPE)) {
+		errno = EIO;
+		return -1;
+	}
+
+	return status;
+}
+
+static bool at45_wait_ready(struct at45_dev *dev, enum at45_op op)
+{
+	return at45_wait_status(dev, op) < 0;
+}
+
+/* Load `len` bytes into SRAM buffer `bufn` starting at `byte` */
+static bool at45_buf_write(struct at45_dev *dev, int bufn, unsigned int byte,
+			   const uint8_t *data, size_t len)
+{
+	uint8_t send_data[4] = {
+		AT45_BUF_WRITE(bufn), byte >> 16, byte >> 8, byte
+	};
+	struct spi_ioc_transfer buf_write[2] = {
+		{
+			.tx_buf = (uintptr_t)send_data,
+			.len = sizeof(send_data),
+			.speed_hz = dev->bus.cmd_hz
+		},
+		{
+			.tx_buf = (uintptr_t)data,
+			.len = len,
+			.speed_hz = dev->bus.cmd_hz
+		}
+	};
+	DO_XFER(buf_write, true);
+
+	return false;
+}
+
+/* Send a 4-byte page command: opcode followed by the page address */
+static bool at45_page_cmd(struct at45_dev *dev, uint8_t opcode,
+			  unsigned int page)
+{
+	uint32_t addr = at45_addr(dev, page * dev->page_sz);
+	uint8_t send_data[4] = { opcode, addr >> 16, addr >> 8, addr };
+	uint8_t recv_data[4] = { 0 }; /* Ignore */
+	DEF_SPI_CMD(page_cmd, send_data, recv_data);
+	DO_XFER(page_cmd, true);
+
+	return false;
+}
+
+/*
+ * Get page `page` into SRAM buffer `bufn` with `len` new bytes from
+ * `data` at `byte`. Partially covered pages are first read into the
+ * buffer so that the data around the new bytes is preserved, which
+ * requires waiting for any program in progress.
+ */
+static bool at45_stage_page(struct at45_dev *dev, int bufn, unsigned int page,
+			    unsigned int byte, const uint8_t *data, size_t len,
+			    enum at45_op *busy)
+{
+	if (len < dev->page_sz) {
+		if ((*busy != AT45_OP_MAX && at45_wait_ready(dev, *busy)) ||
+		    at45_page_cmd(dev, AT45_PAGE_TO_BUF(bufn), page) ||
+		    at45_wait_ready(dev, AT45_OP_XFR))
+			return true;
+		*busy = AT45_OP_MAX;
+	}
+
+	return at45_buf_write(dev, bufn, byte, data, len);
+}
+
+/* Buffer to load while `bufn` is being programmed */
+static int at45_next_buf(const struct chip *chip, int bufn)
+{
+	return chip->buffers > 1 ? !bufn : 0;
+}
+
+/*
+ * Find the SRAM buffer that already holds a full page equal to `data`.
+ * `resident` points to the image data last loaded into each buffer.
+ */
+static int at45_resident_buf(const uint8_t *resident[2], const uint8_t *data,
+			     unsigned int page_sz)
+{
+	int bufn;
+
+	for (bufn = 0; bufn < 2; ++bufn) {
+		if (resident[bufn] &&
+		    (resident[bufn] == data ||
+		     !memcmp(resident[bufn], data, page_sz)))
+			return bufn;
+	}
+
+	return -1;
+}
+
+/*
+ * Program pages `first` to `first + count - 1` with the full pages
+ * `src[0]` to `src[count - 1]` as `action` (indexed by page) says. Pages are staged
+ * alternately in Buffer 1 and Buffer 2: as soon as the device is ready,
+ * a single message starts programming page N from one buffer and loads
+ * the next page into the other, so the host transfer overlaps the
+ * program time. A page equal to the one still resident in either
+ * buffer (padding, repeated tables) is programmed from that buffer
+ * without a reload.
+ */
+static bool at45_program_pages(struct at45_dev *dev, const uint8_t *const *src,
+			       unsigned int first, unsigned int count,
+			       const uint8_t *action)
+{
+	const struct chip *chip = dev->chip;
+	unsigned int page_sz = dev->page_sz;
+	enum at45_op busy = AT45_OP_MAX; /* Nothing in progress */
+	const uint8_t *resident[2] = { NULL, NULL };
+	int bufn = -1; /* Buffer holding the current page */
+	int prog_bufn = 1; /* Buffer being programmed */
+	unsigned int i, next;
+
+	for (i = 0; i < count; ++i) {
+		unsigned int page = first + i;
+		const uint8_t *data = src[i];
+		bool erase = action[page] == PLAN_EP;
+		struct at45_batch batch;
+
+		if (action[page] == PLAN_NONE)
+			continue;
+
+		if (action[page] == PLAN_PE) {
+			if ((busy != AT45_OP_MAX &&
+			     at45_wait_ready(dev, busy)) ||
+			    at45_page_cmd(dev, AT45_PAGE_ERASE, page))
+				return true;
+			busy = AT45_OP_PE;
+			continue;
+		}
+
+		if (bufn < 0)
+			bufn = at45_resident_buf(resident, data, page_sz);
+
+		if (bufn < 0) {
+			bufn = at45_next_buf(chip, prog_bufn);
+			if (bufn == prog_bufn && busy != AT45_OP_MAX) {
+				if (at45_wait_ready(dev, busy))
+					return true;
+				busy = AT45_OP_MAX;
+			}
+			if (at45_buf_write(dev, bufn, 0, data, page_sz))
+				return true;
+			resident[bufn] = data;
+		}
+
+		if (busy != AT45_OP_MAX && at45_wait_ready(dev, busy))
+			return true;
+
+		at45_batch_init(&batch, dev->bus.cmd_hz);
+		at45_batch_cmd(&batch, erase ? AT45_BUF_PROG_ERASE(bufn)
+					     : AT45_BUF_PROG(bufn),
+			       at45_addr(dev, page * page_sz), 4,
+			       NULL, NULL, 0);
+		prog_bufn = bufn;
+		bufn = -1;
+
+		for (next = i + 1; next < count; ++next) {
+			if (action[first + next] == PLAN_PROG ||
+			    action[first + next] == PLAN_EP)
+				break;
+		}
+
+		/*
+		 * Overlap loading the next page to program with
+		 * programming, which needs a second buffer
+		 */
+		if (next < count) {
+			const uint8_t *next_data = src[next];
+
+			bufn = at45_resident_buf(resident, next_data, page_sz);
+			if (bufn < 0 && chip->buffers > 1) {
+				bufn = !prog_bufn;
+				at45_batch_cmd(&batch, AT45_BUF_WRITE(bufn), 0,
+					       4, next_data, NULL, page_sz);
+				resident[bufn] = next_data;
+			}
+		}
+
+		if (at45_batch_run(dev, &batch))
+			return true;
+
+		busy = erase ? AT45_OP_EP : AT45_OP_P;
+	}
+
+	return busy != AT45_OP_MAX && at45_wait_ready(dev, busy);
+}
+
+/*
+ * Compare page `page` with `len` bytes of `data` at `byte` on chip:
+ * the expected data is loaded into SRAM buffer `bufn` and the device
+ * compares it with the main memory page. Only partially covered pages
+ * need the page read into the buffer first. While a program from the
+ * other buffer is in progress, the buffer is loaded before waiting for
+ * it. The buffer keeps the expected page afterwards. Returns 1 on
+ * mismatch, 0 on match, or -1 on error.
+ */
+static int at45_compare_page(struct at45_dev *dev, int bufn, unsigned int page,
+			     unsigned int byte, const uint8_t *data, size_t len,
+			     enum at45_op *busy)
+{
+	uint32_t addr = at45_addr(dev, page * dev->page_sz);
+	struct at45_batch batch;
+	int status;
+
+	if (len < dev->page_sz || *busy != AT45_OP_MAX) {
+		if (at45_stage_page(dev, bufn, page, byte, data, len, busy))
+			return -1;
+		len = 0;
+	}
+
+	if (*busy != AT45_OP_MAX && at45_wait_ready(dev, *busy))
+		return -1;
+	*busy = AT45_OP_MAX;
+
+	at45_batch_init(&batch, dev->bus.cmd_hz);
+	if (len)
+		at45_batch_cmd(&batch, AT45_BUF_WRITE(bufn), 0, 4,
+			       data, NULL, len);
+	at45_batch_cmd(&batch, AT45_PAGE_CMP_BUF(bufn), addr, 4, NULL, NULL, 0);
+	if (at45_batch_run(dev, &batch))
+		return -1;
+
+	status = at45_wait_status(dev, AT45_OP_XFR);
+	if (status < 0)
+		return -1;
+
+	return !!(status & AT45_STATUS_COMP);
+}
+
+/*
+ * Verify `len` bytes at `offset` using the on-chip compare, so only
+ * the expected data crosses the bus.
+ */
+int at45_verify(struct at45_dev *dev, const uint8_t *data, uint32_t offset,
+		size_t len, uint8_t *mismatch)
+{
+	unsigned int page_sz = dev->page_sz;
+	size_t chip_sz = at45_chip_sz(dev);
+	enum at45_op busy = AT45_OP_MAX;
+	int mismatches = 0;
+
+	if (offset >= chip_sz || len > chip_sz - offset)
+		return -EINVAL;
+
+	while (len) {
+		unsigned int page = offset / page_sz;
+		unsigned int byte = offset % page_sz;
+		size_t chunk = page_sz - byte;
+		int rc;
+
+		if (chunk > len)
+			chunk = len;
+
+		rc = at45_compare_page(dev, 0, page, byte, data, chunk, &busy);
+		if (rc < 0)
+			return -errno;
+
+		if (rc) {
+			if (mismatch)
+				mismatch[page / 8] |= 1 << page % 8;
+			mismatches++;
+		}
+
+		offset += chunk;
+		data += chunk;
+		len -= chunk;
+	}
+
+	return mismatches;
+}
+
+/*
+ * Reads are split into whole pages per message, so that each can be
+ * checked as it arrives.
+ */
+int at45_blank_check(struct at45_dev *dev, unsigned int first,
+		     unsigned int count, uint8_t *bitmap, bool stop)
+{
+	unsigned int page_sz = dev->page_sz;
+	unsigned int chunk_pages = dev->t->bufsiz / page_sz;
+	unsigned int page, i, n;
+	uint8_t *buf;
+	int blank = 0;
+
+	if (first >= dev->chip->pages || count > dev->chip->pages - first)
+		return -EINVAL;
+
+	if (!chunk_pages)
+		chunk_pages = 1; /* at45_read() splits it */
+
+	buf = malloc((size_t)chunk_pages * page_sz);
+	if (!buf)
+		return -ENOMEM;
+
+	for (page = first; page < first + count; page += n) {
+		int rc;
+
+		n = first + count - page;
+		if (n > chunk_pages)
+			n = chunk_pages;
+
+		rc = at45_read(dev, page * page_sz, buf, (size_t)n * page_sz);
+		if (rc) {
+			blank = rc;
+			break;
+		}
+
+		for (i = 0; i < n; ++i) {
+			if (!mem_blank(buf + (size_t)i * page_sz, page_sz)) {
+				if (stop)
+					goto out;
+				continue;
+			}
+			if (bitmap)
+				bitmap[(page + i) / 8] |= 1 << (page + i) % 8;
+			blank++;
+		}
+	}
+
+out:
+	free(buf);
+	return blank;
+}
+
+/* Start the bulk erase `op` */
+static bool at45_erase_cmd(struct at45_dev *dev, const struct plan_op *op)
+{
+	static const uint8_t erase_cmd[] = {
+		[AT45_OP_BE] = AT45_BLOCK_ERASE,
+		[AT45_OP_SE] = AT45_SECTOR_ERASE,
+	};
+	uint8_t send_data[4] = { AT45_CHIP_ERASE };
+	uint8_t recv_data[4] = { 0 }; /* Ignore */
+	DEF_SPI_CMD(chip_erase, send_data, recv_data);
+
+	if (op->op != AT45_OP_CE)
+		return at45_page_cmd(dev, erase_cmd[op->op], op->page);
+
+	DO_XFER(chip_erase, true);
+
+	return false;
+}
+
+/* 64-bit FNV-1a */
+static uint64_t fnv1a(const uint8_t *data, size_t len)
+{
+	uint64_t hash = 0xCBF29CE484222325ULL;
+
+	while (len--) {
+		hash ^= *data++;
+		hash *= 0x100000001B3ULL;
+	}
+
+	return hash;
+}
+
+/*
+ * The region is read at a safe baseline clock for reference, then the
+ * clock is raised in 25% steps, each time with the read command
+ * at45_set_clock() would choose, until a read hashes differently or
+ * the chip's limit is reached. The clock to use is TUNE_MARGIN percent
+ * of the fastest good one, unless that was the chip's limit.
+ */
+int at45_tune_clock(struct at45_dev *dev, uint32_t offset, size_t len,
+		    bool low_power, at45_tune_cb *cb, void *arg)
+{
+	size_t chip_sz = at45_chip_sz(dev);
+	uint32_t hz, good = 0;
+	bool limit = false;
+	uint8_t *buf;
+	uint64_t ref;
+	int i, rc;
+
+	if (offset >= chip_sz)
+		return -EINVAL;
+
+	if (!len)
+		len = TUNE_LEN;
+	if (len > chip_sz - offset)
+		len = chip_sz - offset;
+
+	buf = malloc(len);
+	if (!buf)
+		return -ENOMEM;
+
+	at45_set_clock(dev, TUNE_START_HZ, low_power);
+	rc = at45_read(dev, offset, buf, len);
+	if (rc)
+		goto out;
+	ref = fnv1a(buf, len);
+
+	for (hz = TUNE_START_HZ; !limit; hz += hz / 4) {
+		at45_set_clock(dev, hz, low_power);
+		limit = dev->bus.read_hz < hz;
+
+		for (i = 0; i < TUNE_READS; ++i) {
+			rc = at45_read(dev, offset, buf, len);
+			if (rc)
+				goto out;
+			if (fnv1a(buf, len) != ref)
+				break;
+		}
+
+		if (cb)
+			cb(arg, read_cmds[dev->bus.read].opcode,
+			   dev->bus.read_hz, i == TUNE_READS);
+		if (i < TUNE_READS)
+			break;
+		good = dev->bus.read_hz;
+	}
+
+	if (!good) {
+		rc = -EIO;
+		goto out;
+	}
+
+	if (!limit) {
+		good = (uint64_t)good * TUNE_MARGIN / 100;
+		if (good < TUNE_START_HZ)
+			good = TUNE_START_HZ;
+	}
+	rc = good;
+
+out:
+	at45_set_clock(dev, rc > 0 ? (uint32_t)rc : TUNE_START_HZ, low_power);
+	free(buf);
+	return rc;
+}
+
+/*
+ * Set PAGE_* `flags` (one per page of the chip) for bringing `len`
+ * bytes at `offset` to `data`, or to `blank` pages if `data` is NULL,
+ * and plan the erases and programs. With AT45_FLASH_UPDATE, unchanged
+ * pages are told by the on-chip compare.
+ */
+static bool at45_plan_flash(struct at45_dev *dev, const uint8_t *data,
+			    uint32_t offset, size_t len, unsigned int mode,
+			    const uint8_t *blank, uint8_t *flags,
+			    struct plan *plan)
+{
+	const struct chip *chip = dev->chip;
+	unsigned int page_sz = dev->page_sz;
+	enum at45_op busy = AT45_OP_MAX;
+	unsigned int first, last, page;
+	uint8_t *erased = NULL;
+	bool err = true;
+
+	memset(plan, 0, sizeof(*plan));
+	if (!len) {
+		plan->action = calloc(chip->pages, 1);
+		return !plan->action;
+	}
+
+	first = offset / page_sz;
+	last = (offset + len - 1) / page_sz;
+
+	/*
+	 * Find the pages that are erased already: they can be programmed
+	 * without erase, and need no on-chip compare to tell if they change.
+	 * Without erase the planner has no choice, and an update expects
+	 * the array to be mostly programmed, so don't bother then.
+	 */
+	if (!(mode & (AT45_FLASH_NO_ERASE | AT45_FLASH_UPDATE))) {
+		int rc;
+
+		erased = calloc((chip->pages + 7) / 8, 1);
+		if (!erased)
+			goto out;
+		rc = at45_blank_check(dev, first, last - first + 1, erased,
+				      false);
+		if (rc < 0) {
+			errno = -rc;
+			goto out;
+		}
+	}
+
+	for (page = first; page <= last; ++page) {
+		size_t start = page == first ? offset % page_sz : 0;
+		size_t end = page == last ? (offset + len - 1) % page_sz + 1
+					  : page_sz;
+		const uint8_t *src = data ? data + ((size_t)page * page_sz +
+						    start - offset)
+					  : blank;
+		int rc = 1;
+
+		if (end - start == page_sz && mem_blank(src, page_sz))
+			flags[page] |= PAGE_TARGET_BLANK;
+
+		if (erased && erased[page / 8] & 1 << page % 8) {
+			flags[page] |= PAGE_BLANK;
+			rc = !mem_blank(src, end - start);
+		}
+		else if (mode & AT45_FLASH_UPDATE) {
+			rc = at45_compare_page(dev, 0, page, start, src,
+					       end - start, &busy);
+			if (rc < 0)
+				goto out;
+		}
+
+		if (rc)
+			flags[page] |= PAGE_DIRTY;
+	}
+
+	if (mode & AT45_FLASH_NO_ERASE) {
+		plan->action = calloc(chip->pages, 1);
+		if (!plan->action)
+			goto out;
+		for (page = first; page <= last; ++page) {
+			if (flags[page] & PAGE_DIRTY) {
+				plan->action[page] = PLAN_PROG;
+				plan->cost += chip->time[AT45_OP_P].typ;
+			}
+		}
+	}
+	else if (plan_erase(chip, flags, plan)) {
+		goto out;
+	}
+
+	err = false;
+out:
+	free(erased);
+	return err;
+}
+
+int at45_plan(struct at45_dev *dev, const uint8_t *data, uint32_t offset,
+	      size_t len, unsigned int mode, struct plan *plan)
+{
+	size_t chip_sz = at45_chip_sz(dev);
+	uint8_t *flags, *blank;
+	int rc = 0;
+
+	if (offset >= chip_sz || len > chip_sz - offset)
+		return -EINVAL;
+
+	flags = calloc(dev->chip->pages, 1);
+	blank = malloc(dev->page_sz);
+	if (!flags || !blank) {
+		rc = -ENOMEM;
+		goto out;
+	}
+	memset(blank, 0xFF, dev->page_sz);
+
+	if (at45_plan_flash(dev, data, offset, len, mode, blank, flags,
+			    plan)) {
+		rc = -errno;
+		plan_free(plan);
+	}
+
+out:
+	free(blank);
+	free(flags);
+	return rc;
+}
+
+void at45_plan_free(struct plan *plan)
+{
+	plan_free(plan);
+}
+
+/*
+ * The cheapest mix of bulk erases, page erases and programs is chosen
+ * by the planner. Pages that a bulk erase would destroy but that
+ * aren't fully covered by the new data are read back first.
+ */
+int at45_write(struct at45_dev *dev, const uint8_t *data, uint32_t offset,
+	       size_t len, unsigned int mode)
+{
+	const struct chip *chip = dev->chip;
+	unsigned int page_sz = dev->page_sz;
+	size_t chip_sz = at45_chip_sz(dev);
+	enum at45_op busy = AT45_OP_MAX;
+	unsigned int first, last, page, lo, hi, copies;
+	uint8_t *flags = NULL, *target = NULL, *blank = NULL;
+	const uint8_t **src = NULL;
+	struct plan plan = { 0 };
+	int done = -ENOMEM;
+	unsigned int i;
+
+	if (offset >= chip_sz || len > chip_sz - offset)
+		return -EINVAL;
+
+	if (!len)
+		return 0;
+
+	first = offset / page_sz;
+	last = (offset + len - 1) / page_sz;
+
+	flags = calloc(chip->pages, 1);
+	blank = malloc(page_sz);
+	if (!flags || !blank)
+		goto out;
+	memset(blank, 0xFF, page_sz);
+
+	if (at45_plan_flash(dev, data, offset, len, mode, blank, flags,
+			    &plan))
+		goto fail;
+
+	for (lo = 0; lo < chip->pages && !plan.action[lo]; ++lo)
+		;
+	for (hi = chip->pages; hi > lo && !plan.action[hi - 1]; --hi)
+		;
+
+	/*
+	 * Fully covered pages are programmed straight from `data`. Only
+	 * the pages the new data doesn't fully cover but that have to be
+	 * programmed get a copy in `target`, read back from the chip.
+	 */
+	src = calloc(hi - lo, sizeof(*src));
+	if (hi > lo && !src)
+		goto out;
+
+	for (page = lo, copies = 0; page < hi; ++page) {
+		bool covered = page >= first && page <= last &&
+			       !(page == first && offset % page_sz) &&
+			       !(page == last && (offset + len) % page_sz);
+
+		if (covered)
+			src[page - lo] = data ? data + ((size_t)page * page_sz -
+							offset)
+					      : blank;
+		else if (plan.action[page] == PLAN_PROG ||
+			 plan.action[page] == PLAN_EP)
+			copies++;
+	}
+
+	target = malloc((size_t)copies * page_sz);
+	if (copies && !target)
+		goto out;
+
+	/* Read back runs of such pages, their copies are consecutive */
+	for (page = lo, copies = 0; page < hi; page = i + 1) {
+		uint8_t *dst = target + (size_t)copies * page_sz;
+
+		for (i = page; i < hi; ++i) {
+			if (src[i - lo] || plan.action[i] == PLAN_NONE ||
+			    plan.action[i] == PLAN_PE)
+				break;
+			src[i - lo] = target + (size_t)copies++ * page_sz;
+		}
+		if (i > page) {
+			done = at45_read(dev, page * page_sz, dst,
+					 (size_t)(i - page) * page_sz);
+			if (done)
+				goto out;
+		}
+	}
+
+	/* Overlay the new data on the partially covered first and last page */
+	for (i = 0; i < 2 && (!i || last != first); ++i) {
+		size_t start, end;
+		uint8_t *dst;
+
+		page = i ? last : first;
+		start = page == first ? offset % page_sz : 0;
+		end = page == last ? (offset + len - 1) % page_sz + 1 : page_sz;
+		if (end - start == page_sz || page < lo || page >= hi ||
+		    !src[page - lo])
+			continue;
+
+		/* Not fully covered, so the page is a copy in `target` */
+		dst = (uint8_t *)src[page - lo] + start;
+		if (data)
+			memcpy(dst, data + ((size_t)page * page_sz + start -
+					    offset), end - start);
+		else
+			memset(dst, 0xFF, end - start);
+	}
+
+	/* Erased pages that stay blank need no programming */
+	for (page = lo; page < hi; ++page) {
+		if (plan.action[page] == PLAN_PROG &&
+		    mem_blank(src[page - lo], page_sz))
+			plan.action[page] = PLAN_NONE;
+	}
+
+	for (i = 0; i < plan.n_ops; ++i) {
+		if ((busy != AT45_OP_MAX && at45_wait_ready(dev, busy)) ||
+		    at45_erase_cmd(dev, &plan.ops[i]))
+			goto fail;
+		busy = plan.ops[i].op;
+	}
+
+	if ((busy != AT45_OP_MAX && at45_wait_ready(dev, busy)) ||
+	    at45_program_pages(dev, src, lo, hi - lo, plan.action))
+		goto fail;
+
+	for (done = 0, page = first; page <= last; ++page)
+		done += !!(flags[page] & PAGE_DIRTY);
+	goto out;
+
+fail:
+	done = -errno;
+out:
+	plan_free(&plan);
+	free(target);
+	free(src);
+	free(blank);
+	free(flags);
+	return done;
+}
+
+int at45_status(struct at45_dev *dev)
+{
+	int status = at45_get_status(dev);
+
+	return status < 0 ? -errno : status;
+}
+
+/* The new page size is in effect once the device is ready again */
+int at45_set_page_size(struct at45_dev *dev, bool binary)
+{
+	unsigned int page_sz;
+
+	if (!(dev->chip->features & CHIP_PAGE_CFG))
+		return -EOPNOTSUPP;
+
+	if (at45_set_page_sz(dev, binary ? AT45_PAGE_256 : AT45_PAGE_264) ||
+	    at45_wait_ready(dev, AT45_OP_EP))
+		return -errno;
+
+	page_sz = at45_get_page_sz(dev);
+	if (!page_sz)
+		return -errno;
+
+	dev->page_sz = page_sz;
+	return 0;
+}
+
+const struct chip *at45_chip(const struct at45_dev *dev)
+{
+	return dev->chip;
+}
+
+unsigned int at45_page_size(const struct at45_dev *dev)
+{
+	return dev->page_sz;
+}
+
+void at45_set_stream_status(struct at45_dev *dev, bool enable)
+{
+	dev->stream_status = enable;
+}
+
+void at45_get_stats(const struct at45_dev *dev, struct at45_stats *stats)
+{
+	*stats = dev->stats;
+	stats->us = dev->t->now(dev->t) - dev->start_us;
+}
+
+/*
+ * The spidev device's parent in sysfs is its controller. Without
+ * sysfs, B in /dev/spidevB.C is the controller's bus number.
+ */
+int at45_bus_name(const char *name, char *bus, size_t size)
+{
+	char path[PATH_MAX], *dev_path, *ctlr;
+	const char *base, *opt;
+	unsigned int busn, cs;
+	int len;
+
+	if (!strncmp(name, EMU_PREFIX, strlen(EMU_PREFIX))) {
+		opt = strstr(name, ",bus=");
+		if (opt)
+			len = snprintf(bus, size, "%sbus%lu", EMU_PREFIX,
+				       strtoul(opt + 5, NULL, 0));
+		else
+			len = snprintf(bus, size, "%s", name);
+		goto out;
+	}
+
+	dev_path = realpath(name, NULL);
+	base = strrchr(dev_path ? dev_path : name, '/');
+	base = base ? base + 1 : name;
+	snprintf(path, sizeof(path), SPIDEV_CLASS "/%s/device/..", base);
+	ctlr = realpath(path, NULL);
+
+	if (ctlr)
+		len = snprintf(bus, size, "%s", ctlr);
+	else if (sscanf(base, "spidev%u.%u", &busn, &cs) == 2)
+		len = snprintf(bus, size, "spi%u", busn);
+	else
+		len = snprintf(bus, size, "%s", name);
+
+	free(ctlr);
+	free(dev_path);
+out:
+	return len < 0 || (size_t)len >= size ? -ENAMETOOLONG : 0;
+}
+
+int at45_open(struct at45_dev **devp, const char *name,
+	      const struct at45_conf *conf)
+{
+	struct at45_conf file_conf = { SPI_SPEED_HZ, false };
+	struct at45_dev *dev;
+	uint32_t id, hz;
+	int rc;
+
+	if (!conf) {
+		unsigned int line;
+
+		rc = conf_load(name, &file_conf, &line);
+		if (rc)
+			return rc;
+		conf = &file_conf;
+	}
+
+	dev = calloc(1, sizeof(*dev));
+	if (!dev)
+		return -ENOMEM;
+
+	if (!strncmp(name, EMU_PREFIX, strlen(EMU_PREFIX)))
+		dev->t = emu_open(name + strlen(EMU_PREFIX));
+	else
+		dev->t = spidev_open(name);
+	if (!dev->t) {
+		rc = -errno;
+		goto fail;
+	}
+
+	dev->start_us = dev->t->now(dev->t);
+	dev->busy = AT45_OP_MAX;
+	dev->loaded = -1;
+	/* Even the ID probe must not outrun a slow board */
+	hz = SPI_CFG_HZ < conf->max_hz ? SPI_CFG_HZ : conf->max_hz;
+	dev->bus = (struct at45_bus){ hz, hz, hz, AT45_READ_HF };
+	if (get_jedec_id(dev, &id)) {
+		rc = -errno;
+		goto fail;
+	}
+
+	dev->chip = chip_find(id);
+	if (!dev->chip) {
+		rc = -ENODEV;
+		goto fail;
+	}
+
+	at45_set_clock(dev, conf->max_hz, conf->low_power);
+	dev->page_sz = at45_get_page_sz(dev);
+	if (!dev->page_sz) {
+		rc = -errno;
+		goto fail;
+	}
+
+	*devp = dev;
+	return 0;
+
+fail:
+	if (dev->t)
+		dev->t->close(dev->t);
+	free(dev);
+	return rc;
+}
+
+int at45_close(struct at45_dev *dev)
+{
+	int rc;
+
+	if (!dev)
+		return 0;
+
+	rc = dev->t->close(dev->t) ? -errno : 0;
+	free(dev);
+	return rc;
+}
+
+struct at45_queue {
+	struct at45_dev *devs; /* Linked by q_next */
+	struct at45_req *done_head, *done_tail;
+	unsigned int pending; /* Submitted but not completed */
+	unsigned int done; /* Completed but not reaped */
+	uint64_t now; /* Latest time seen on any of the devices */
+};
+
+struct at45_queue *at45_queue_new(void)
+{
+	return calloc(1, sizeof(struct at45_queue));
+}
+
+void at45_queue_free(struct at45_queue *q)
+{
+	struct at45_dev *dev;
+
+	if (!q)
+		return;
+
+	/* Let the synchronous functions find the devices ready */
+	for (dev = q->devs; dev; dev = dev->q_next) {
+		if (dev->busy != AT45_OP_MAX)
+			at45_wait_ready(dev, dev->busy);
+		dev->busy = AT45_OP_MAX;
+		dev->loaded = -1;
+		dev->q_head = dev->q_tail = NULL;
+		dev->q = NULL;
+	}
+
+	free(q);
+}
+
+int at45_submit(struct at45_queue *q, struct at45_req *req)
+{
+	struct at45_dev *dev = req->dev, **tail;
+	size_t chip_sz = at45_chip_sz(dev);
+
+	if (dev->q && dev->q != q)
+		return -EBUSY;
+
+	switch (req->op) {
+	case AT45_REQ_STATUS:
+		break;
+	case AT45_REQ_WRITE:
+	case AT45_REQ_ERASE:
+	case AT45_REQ_VERIFY:
+	case AT45_REQ_BLANK:
+		if (req->offset % dev->page_sz || req->len % dev->page_sz)
+			return -EINVAL;
+		/* fall through */
+	case AT45_REQ_READ:
+		if (req->offset > chip_sz || req->len > chip_sz - req->offset)
+			return -EINVAL;
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	if (!dev->q) {
+		for (tail = &q->devs; *tail; tail = &(*tail)->q_next)
+			;
+		*tail = dev;
+		dev->q_next = NULL;
+		dev->q = q;
+	}
+
+	req->next = NULL;
+	req->page = 0;
+	req->result = 0;
+	if (dev->q_tail)
+		dev->q_tail->next = req;
+	else
+		dev->q_head = req;
+	dev->q_tail = req;
+	q->pending++;
+
+	return 0;
+}
+
+/* Move the request at the head of `dev`'s queue to the completed ones */
+static void at45_q_complete(struct at45_queue *q, struct at45_dev *dev,
+			    int result)
+{
+	struct at45_req *req = dev->q_head;
+
+	dev->q_head = req->next;
+	if (!dev->q_head)
+		dev->q_tail = NULL;
+	dev->loaded = -1;
+
+	req->result = result;
+	req->next = NULL;
+	if (q->done_tail)
+		q->done_tail->next = req;
+	else
+		q->done_head = req;
+	q->done_tail = req;
+
+	q->pending--;
+	q->done++;
+}
+
+/* Internal operation `op` has just been started, see at45_wait_status() */
+static void at45_q_busy(struct at45_dev *dev, enum at45_op op)
+{
+	uint64_t now = dev->t->now(dev->t);
+	unsigned int typ = dev->chip->time[op].typ;
+
+	dev->busy = op;
+	dev->poll_at = now + typ;
+	dev->deadline = now + 2 * dev->chip->time[op].max;
+	dev->backoff = typ / 16 ? typ / 16 : 10;
+}
+
+/*
+ * Check a busy device that is due. Returns the status once it is
+ * ready, 0 while it is still busy, or -1 on error like
+ * at45_wait_status().
+ */
+static int at45_q_poll(struct at45_dev *dev)
+{
+	enum at45_op op = dev->busy;
+	int status = at45_get_status(dev);
+	uint64_t now = dev->t->now(dev->t);
+
+	if (status >= 0 && !(status & AT45_STATUS_READY)) {
+		if (now <= dev->deadline) {
+			dev->poll_at = now + dev->backoff;
+			if (dev->backoff < dev->chip->time[op].typ / 4)
+				dev->backoff *= 2;
+			return 0;
+		}
+		errno = ETIMEDOUT;
+		status = -1;
+	}
+
+	dev->busy = AT45_OP_MAX;
+	if (status < 0)
+		return -1;
+
+	if (op != AT45_OP_XFR && (dev->chip->features & CHIP_STATUS2) &&
+	    (status & AT45_STATUS_EPE)) {
+		errno = EIO;
+		return -1;
+	}
+
+	return status;
+}
+
+/*
+ * Start programming the next page of `req` in one message: the page is
+ * loaded into a buffer unless it was loaded together with the previous
+ * program, and the page after it goes into the other buffer.
+ */
+static bool at45_q_program(struct at45_dev *dev, struct at45_req *req)
+{
+	unsigned int page_sz = dev->page_sz;
+	unsigned int count = req->len / page_sz;
+	const uint8_t *data = (const uint8_t *)req->buf +
+			      (size_t)req->page * page_sz;
+	bool erase = !(req->mode & AT45_FLASH_NO_ERASE);
+	int bufn = dev->loaded;
+	struct at45_batch batch;
+
+	at45_batch_init(&batch, dev->bus.cmd_hz);
+	if (bufn < 0) {
+		bufn = 0;
+		at45_batch_cmd(&batch, AT45_BUF_WRITE(bufn), 0, 4, data, NULL,
+			       page_sz);
+	}
+	at45_batch_cmd(&batch, erase ? AT45_BUF_PROG_ERASE(bufn)
+				     : AT45_BUF_PROG(bufn),
+		       at45_addr(dev, req->offset + req->page * page_sz), 4,
+		       NULL, NULL, 0);
+
+	dev->loaded = -1;
+	if (req->page + 1 < count && dev->chip->buffers > 1) {
+		dev->loaded = !bufn;
+		at45_batch_cmd(&batch, AT45_BUF_WRITE(dev->loaded), 0, 4,
+			       data + page_sz, NULL, page_sz);
+	}
+
+	if (at45_batch_run(dev, &batch))
+		return true;
+
+	req->page++;
+	at45_q_busy(dev, erase ? AT45_OP_EP : AT45_OP_P);
+	return false;
+}
+
+/*
+ * The erase for `page` with `count` pages to go from there: the chip,
+ * sector or block starting at `page` if the range covers it and it is
+ * faster than erasing its parts, or else the page alone.
+ */
+static enum at45_op at45_q_erase_op(const struct chip *chip,
+				    unsigned int page, unsigned int count,
+				    unsigned int *pages)
+{
+	unsigned int sector_start, sector_pages;
+
+	/* Sector 0 is split into 0a and 0b, which count as two */
+	if (!page && count >= chip->pages &&
+	    chip->time[AT45_OP_CE].typ < (chip->pages / chip->sector_pages + 1) *
+					 chip->time[AT45_OP_SE].typ) {
+		*pages = chip->pages;
+		return AT45_OP_CE;
+	}
+
+	if (page < chip->block_pages) {
+		sector_start = 0;
+		sector_pages = chip->block_pages;
+	}
+	else if (page < chip->sector_pages) {
+		sector_start = chip->block_pages;
+		sector_pages = chip->sector_pages - chip->block_pages;
+	}
+	else {
+		sector_start = page - page % chip->sector_pages;
+		sector_pages = chip->sector_pages;
+	}
+	if (page == sector_start && count >= sector_pages &&
+	    chip->time[AT45_OP_SE].typ < sector_pages / chip->block_pages *
+					 chip->time[AT45_OP_BE].typ) {
+		*pages = sector_pages;
+		return AT45_OP_SE;
+	}
+
+	if (!(page % chip->block_pages) && count >= chip->block_pages &&
+	    chip->time[AT45_OP_BE].typ <
+	    chip->block_pages * chip->time[AT45_OP_PE].typ) {
+		*pages = chip->block_pages;
+		return AT45_OP_BE;
+	}
+
+	*pages = 1;
+	return AT45_OP_PE;
+}
+
+/* Start erasing the next part of `req`, see at45_q_erase_op() */
+static bool at45_q_erase(struct at45_dev *dev, struct at45_req *req)
+{
+	unsigned int count = req->len / dev->page_sz;
+	struct plan_op op;
+
+	op.page = req->offset / dev->page_sz + req->page;
+	op.op = at45_q_erase_op(dev->chip, op.page, count - req->page,
+				&op.pages);
+
+	if (op.op == AT45_OP_PE ? at45_page_cmd(dev, AT45_PAGE_ERASE, op.page)
+				: at45_erase_cmd(dev, &op))
+		return true;
+
+	req->page += op.pages;
+	at45_q_busy(dev, op.op);
+	return false;
+}
+
+/*
+ * Start comparing the next page of `req`: the expected data is loaded
+ * into a buffer and compared with the page in one message.
+ */
+static bool at45_q_compare(struct at45_dev *dev, struct at45_req *req)
+{
+	unsigned int page_sz = dev->page_sz;
+	const uint8_t *data = (const uint8_t *)req->buf +
+			      (size_t)req->page * page_sz;
+	struct at45_batch batch;
+
+	at45_batch_init(&batch, dev->bus.cmd_hz);
+	at45_batch_cmd(&batch, AT45_BUF_WRITE(0), 0, 4, data, NULL, page_sz);
+	at45_batch_cmd(&batch, AT45_PAGE_CMP_BUF(0),
+		       at45_addr(dev, req->offset + req->page * page_sz), 4,
+		       NULL, NULL, 0);
+	if (at45_batch_run(dev, &batch))
+		return true;
+
+	req->page++;
+	at45_q_busy(dev, AT45_OP_XFR);
+	return false;
+}
+
+/* Check as many pages of `req` as one message carries */
+static void at45_q_blank(struct at45_queue *q, struct at45_dev *dev,
+			 struct at45_req *req)
+{
+	unsigned int count = req->len / dev->page_sz - req->page;
+	unsigned int chunk = dev->t->bufsiz / dev->page_sz;
+	int rc;
+
+	if (!chunk)
+		chunk = 1;
+	if (chunk > count)
+		chunk = count;
+
+	rc = chunk ? at45_blank_check(dev, req->offset / dev->page_sz +
+					   req->page, chunk, NULL, true) : 0;
+	if (rc < 0) {
+		at45_q_complete(q, dev, rc);
+		return;
+	}
+
+	req->page += rc;
+	if ((unsigned int)rc < chunk || req->page == req->len / dev->page_sz)
+		at45_q_complete(q, dev, req->page);
+}
+
+/*
+ * Advance the request at the head of `dev`'s queue by one message if
+ * the device is due. Returns true if the request got anywhere.
+ */
+static bool at45_q_step(struct at45_queue *q, struct at45_dev *dev)
+{
+	struct at45_req *req = dev->q_head;
+	struct transport *t = dev->t;
+	uint64_t now = t->now(t);
+	bool progress = true;
+	int rc;
+
+	if (!req)
+		return false;
+
+	/*
+	 * Transfers to the other devices took time as well, which
+	 * backends with a clock of their own have to be told about
+	 */
+	if (now < q->now)
+		t->delay(t, q->now - now);
+
+	if (req->op == AT45_REQ_STATUS) {
+		rc = at45_get_status(dev);
+		at45_q_complete(q, dev, rc < 0 ? -errno : rc);
+		goto out;
+	}
+
+	if (dev->busy != AT45_OP_MAX) {
+		if (t->now(t) < dev->poll_at)
+			return false;
+
+		rc = at45_q_poll(dev);
+		if (!rc) {
+			progress = false;
+			goto out;
+		}
+		if (rc < 0) {
+			at45_q_complete(q, dev, -errno);
+			goto out;
+		}
+
+		/* The compare of the previous page has finished */
+		if (req->op == AT45_REQ_VERIFY && (rc & AT45_STATUS_COMP)) {
+			unsigned int page = req->offset / dev->page_sz +
+					    req->page - 1;
+
+			if (req->mismatch)
+				req->mismatch[page / 8] |= 1 << page % 8;
+			req->result++;
+		}
+	}
+
+	switch (req->op) {
+	case AT45_REQ_READ:
+		at45_q_complete(q, dev, at45_read(dev, req->offset, req->buf,
+						  req->len));
+		break;
+	case AT45_REQ_BLANK:
+		at45_q_blank(q, dev, req);
+		break;
+	case AT45_REQ_WRITE:
+	case AT45_REQ_ERASE:
+	case AT45_REQ_VERIFY:
+		if (req->page == req->len / dev->page_sz) {
+			at45_q_complete(q, dev, req->op == AT45_REQ_VERIFY ?
+						req->result : (int)req->page);
+			break;
+		}
+		if (req->op == AT45_REQ_WRITE ? at45_q_program(dev, req) :
+		    req->op == AT45_REQ_ERASE ? at45_q_erase(dev, req) :
+						at45_q_compare(dev, req)) {
+			dev->busy = AT45_OP_MAX;
+			at45_q_complete(q, dev, -errno);
+		}
+		break;
+	default:
+		break;
+	}
+
+out:
+	now = t->now(t);
+	if (now > q->now)
+		q->now = now;
+	return progress;
+}
+
+/*
+ * Every pass gives each device with requests a step. Once no device
+ * can move on, the thread sleeps until the first busy one is due.
+ */
+int at45_reap(struct at45_queue *q, struct at45_req **done, unsigned int max,
+	      unsigned int min)
+{
+	unsigned int n = 0;
+
+	while (q->done < min && q->pending) {
+		struct at45_dev *dev, *next = NULL;
+		bool progress = false;
+		uint64_t now;
+
+		for (dev = q->devs; dev; dev = dev->q_next)
+			progress |= at45_q_step(q, dev);
+		if (progress)
+			continue;
+
+		for (dev = q->devs; dev; dev = dev->q_next) {
+			if (dev->q_head && dev->busy != AT45_OP_MAX &&
+			    (!next || dev->poll_at < next->poll_at))
+				next = dev;
+		}
+		if (!next)
+			continue;
+
+		now = next->t->now(next->t);
+		if (now > q->now)
+			q->now = now;
+		if (next->poll_at > q->now) {
+			spi_delay(next, next->poll_at - q->now);
+			q->now = next->poll_at;
+		}
+	}
+
+	while (n < max && q->done_head) {
+		done[n++] = q->done_head;
+		q->done_head = q->done_head->next;
+		q->done--;
+	}
+	if (!q->done_head)
+		q->done_tail = NULL;
+
+	return n;
+}
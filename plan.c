@@ -0,0 +1,180 @@
+/*
+ * Copyright (C) 2019 Alexander Amelkin <alexander@amelkin.msk.ru>
+ *
+ * Erase planner. The chip is a tree of areas: the chip consists of
+ * sectors (sector 0 being split into 0a and 0b), sectors of blocks and
+ * blocks of pages. For every area the cheaper of erasing it as a whole
+ * (and programming back all its non-blank pages) and handling each of
+ * its parts separately is chosen, bottom-up.
+ */
+
+#include <stdlib.h>
+
+#include "plan.h"
+
+enum plan_level {
+	LEVEL_CHIP,
+	LEVEL_SECTOR,
+	LEVEL_BLOCK,
+	LEVEL_PAGE,
+};
+
+static const enum at45_op level_op[] = {
+	[LEVEL_CHIP] = AT45_OP_CE,
+	[LEVEL_SECTOR] = AT45_OP_SE,
+	[LEVEL_BLOCK] = AT45_OP_BE,
+};
+
+struct planner {
+	const struct chip *chip;
+	const uint8_t *flags;
+	unsigned int *dirty; /* Number of dirty pages before each page */
+	struct plan *plan;
+};
+
+static unsigned int child_pages(struct planner *pl, enum plan_level level,
+				unsigned int page)
+{
+	const struct chip *chip = pl->chip;
+
+	switch (level) {
+	case LEVEL_CHIP:
+		if (page < chip->block_pages)
+			return chip->block_pages; /* Sector 0a */
+		if (page < chip->sector_pages)
+			return chip->sector_pages - chip->block_pages; /* 0b */
+		return chip->sector_pages;
+	case LEVEL_SECTOR:
+		return chip->block_pages;
+	default:
+		return 1;
+	}
+}
+
+static uint64_t plan_page(struct planner *pl, unsigned int page, bool emit)
+{
+	const struct chip *chip = pl->chip;
+	uint8_t flags = pl->flags[page];
+	enum plan_action action;
+	uint64_t cost;
+
+	if (!(flags & PAGE_DIRTY)) {
+		action = PLAN_NONE;
+		cost = 0;
+	}
+	else if (flags & PAGE_BLANK) {
+		action = PLAN_PROG;
+		cost = chip->time[AT45_OP_P].typ;
+	}
+	else if (flags & PAGE_TARGET_BLANK) {
+		action = PLAN_PE;
+		cost = chip->time[AT45_OP_PE].typ;
+	}
+	else {
+		action = PLAN_EP;
+		cost = chip->time[AT45_OP_EP].typ;
+	}
+
+	if (emit)
+		pl->plan->action[page] = action;
+
+	return cost;
+}
+
+/* Erase the area as a whole and program back what isn't blank */
+static uint64_t plan_bulk(struct planner *pl, enum plan_level level,
+			  unsigned int first, unsigned int count, bool emit)
+{
+	const struct chip *chip = pl->chip;
+	uint64_t cost = chip->time[level_op[level]].typ;
+	unsigned int page;
+
+	for (page = first; page < first + count; ++page) {
+		bool blank = pl->flags[page] & PAGE_TARGET_BLANK;
+
+		if (!blank)
+			cost += chip->time[AT45_OP_P].typ;
+		if (emit)
+			pl->plan->action[page] = blank ? PLAN_NONE : PLAN_PROG;
+	}
+
+	if (emit) {
+		struct plan_op *op = &pl->plan->ops[pl->plan->n_ops++];
+
+		op->op = level_op[level];
+		op->page = first;
+		op->pages = count;
+	}
+
+	return cost;
+}
+
+static uint64_t plan_level(struct planner *pl, enum plan_level level,
+			   unsigned int first, unsigned int count, bool emit)
+{
+	uint64_t parts = 0, bulk;
+	unsigned int page, n;
+
+	if (level == LEVEL_PAGE)
+		return plan_page(pl, first, emit);
+
+	/* Nothing to do in the area, actions are PLAN_NONE already */
+	if (pl->dirty[first + count] == pl->dirty[first])
+		return 0;
+
+	for (page = first; page < first + count; page += n) {
+		n = child_pages(pl, level, page);
+		parts += plan_level(pl, level + 1, page, n, false);
+	}
+
+	bulk = plan_bulk(pl, level, first, count, false);
+	if (bulk < parts) {
+		if (emit)
+			plan_bulk(pl, level, first, count, true);
+		return bulk;
+	}
+
+	if (emit) {
+		for (page = first; page < first + count; page += n) {
+			n = child_pages(pl, level, page);
+			plan_level(pl, level + 1, page, n, true);
+		}
+	}
+
+	return parts;
+}
+
+bool plan_erase(const struct chip *chip, const uint8_t *flags,
+		struct plan *plan)
+{
+	struct planner pl = { chip, flags, NULL, plan };
+	unsigned int page;
+
+	plan->n_ops = 0;
+	plan->ops = calloc(chip->pages / chip->block_pages + 1,
+			   sizeof(*plan->ops));
+	plan->action = calloc(chip->pages, sizeof(*plan->action));
+	pl.dirty = calloc(chip->pages + 1, sizeof(*pl.dirty));
+	if (!plan->ops || !plan->action || !pl.dirty) {
+		free(pl.dirty);
+		plan_free(plan);
+		return true;
+	}
+
+	for (page = 0; page < chip->pages; ++page)
+		pl.dirty[page + 1] = pl.dirty[page] +
+				     !!(flags[page] & PAGE_DIRTY);
+
+	plan->cost = plan_level(&pl, LEVEL_CHIP, 0, chip->pages, true);
+
+	free(pl.dirty);
+	return false;
+}
+
+void plan_free(struct plan *plan)
+{
+	free(plan->ops);
+	free(plan->action);
+	plan->ops = NULL;
+	plan->action = NULL;
+}
@@ -0,0 +1,50 @@
+/*
+ * Copyright (C) 2019 Alexander Amelkin <alexander@amelkin.msk.ru>
+ */
+
+#ifndef PLAN_H
+#define PLAN_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "chips.h"
+
+/* Page state, input to the planner */
+#define PAGE_DIRTY (1 << 0) /* Contents have to change */
+#define PAGE_TARGET_BLANK (1 << 1) /* New contents are all 0xFF */
+#define PAGE_BLANK (1 << 2) /* Erased already, programs without erase */
+
+/* What happens to a page after the erase operations */
+enum plan_action {
+	PLAN_NONE,
+	PLAN_PROG,	/* Erased already or by a bulk erase, program only */
+	PLAN_EP,	/* Program with built-in erase */
+	PLAN_PE,	/* Page erase */
+};
+
+struct plan_op {
+	enum at45_op op; /* AT45_OP_BE, AT45_OP_SE or AT45_OP_CE */
+	unsigned int page; /* First page of the erased area */
+	unsigned int pages;
+};
+
+struct plan {
+	struct plan_op *ops;
+	unsigned int n_ops;
+	uint8_t *action; /* enum plan_action for every page of the chip */
+	uint64_t cost; /* Estimated time, microseconds */
+};
+
+/*
+ * Choose the cheapest mix of chip, sector, block and page erases and
+ * programs that brings every page with PAGE_DIRTY in `flags` (one per
+ * page of the chip) to its new contents. Any bulk erase requires all
+ * non-blank pages in the area, dirty or not, to be programmed again.
+ * Returns true and sets errno on failure.
+ */
+bool plan_erase(const struct chip *chip, const uint8_t *flags,
+		struct plan *plan);
+void plan_free(struct plan *plan);
+
+#endif /* PLAN_H */
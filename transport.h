@@ -0,0 +1,53 @@
+/*
+ * Copyright (C) 2019 Alexander Amelkin <alexander@amelkin.msk.ru>
+ */
+
+#ifndef TRANSPORT_H
+#define TRANSPORT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <linux/spi/spidev.h>
+
+/*
+ * SPI transport. All bus traffic goes through xfer(), which has the
+ * semantics of SPI_IOC_MESSAGE(n): returns a negative value and sets
+ * errno on failure. delay() is used for all waits on the device and
+ * now() for all timekeeping, in microseconds, so that backends with
+ * their own notion of time can account for them.
+ */
+struct transport {
+	int (*xfer)(struct transport *t, struct spi_ioc_transfer *xfer,
+		    unsigned int n);
+	void (*delay)(struct transport *t, unsigned int us);
+	uint64_t (*now)(struct transport *t);
+	/* Returns -1 and sets errno if the device state could not be saved */
+	int (*close)(struct transport *t);
+	/* Set SPI_IOC_WR_MODE32 bits, returns the resulting mode or -1 */
+	int (*set_mode)(struct transport *t, uint32_t bits);
+	size_t bufsiz; /* Most tx or rx bytes a single message may carry */
+};
+
+#define EMU_PREFIX "emu:"
+
+/* /dev/spidevB.C */
+struct transport *spidev_open(const char *path);
+
+/*
+ * In-process AT45DB041E model. `spec` is
+ * "[<file>][,vclock][,bufsiz=<n>][,maxhz=<n>][,bus=<n>]": the file holds
+ * the array contents (pages of 264 bytes) and is written back on close. With
+ * vclock the model runs on a virtual clock that advances by the bus time
+ * of every transfer and by every delay instead of sleeping. Messages are
+ * limited to bufsiz bytes each way (4096 by default) like spidev's.
+ * Transfers clocked faster than maxhz receive occasional bit errors,
+ * like a marginal board. Emulators with the same bus are scheduled as
+ * if they shared an SPI controller. Returns NULL and sets errno, EINVAL
+ * for an unknown option.
+ */
+struct transport *emu_open(const char *spec);
+
+/* Microseconds the emulated device has spent busy so far */
+uint64_t emu_busy_time(struct transport *t);
+
+#endif /* TRANSPORT_H */